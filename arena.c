@@ -0,0 +1,160 @@
+#ifndef ARENA_C_
+#define ARENA_C_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Chunked bump allocator with free lists. Block sizes are rounded up to a
+// power of two (at least ARENA_MIN bytes) so a released block can be handed
+// out again for any later request of the same size class. Blocks of
+// ARENA_CHUNK bytes or more get a chunk of their own outside the bump chain,
+// which goes back to the system as soon as the block is released: a growing
+// array doubles through every large size class once and never asks for the
+// old ones again. arena_reset() rewinds every chunk and forgets the free
+// lists but keeps the bump chunks for the next scene; arena_free() gives
+// everything back to the system.
+
+#define ARENA_CHUNK (1 << 20)
+#define ARENA_MIN 64
+#define ARENA_ALIGN 64
+#define ARENA_CLASSES 48
+
+typedef struct Arena_Chunk {
+	struct Arena_Chunk *next;
+	unsigned char *data;
+	size_t size;
+	size_t used;
+} Arena_Chunk;
+
+typedef struct {
+	Arena_Chunk *chunks;
+	Arena_Chunk *current;
+	Arena_Chunk *large;   // one chunk per block of ARENA_CHUNK bytes or more
+	void *free[ARENA_CLASSES];
+	size_t reserved;   // bytes obtained from malloc for chunk data
+	size_t live;       // bytes in blocks handed out and not released
+	size_t peak;
+} Arena;
+
+static size_t arena_class(size_t size, size_t *block)
+{
+	size_t k = 0, b = ARENA_MIN;
+	while (b < size) {
+		b <<= 1;
+		++k;
+	}
+	*block = b;
+	return k;
+}
+
+static Arena_Chunk *arena_chunk(Arena *a, size_t size)
+{
+	if (size < ARENA_CHUNK) size = ARENA_CHUNK;
+	Arena_Chunk *c = malloc(sizeof(Arena_Chunk) + size + ARENA_ALIGN);
+	if (c == NULL) return NULL;
+	uintptr_t p = (uintptr_t) (c + 1);
+	c->data = (unsigned char *) ((p + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1));
+	c->size = size;
+	c->used = 0;
+	c->next = NULL;
+	a->reserved += size;
+	return c;
+}
+
+// Returns a block of at least `size` bytes aligned to ARENA_ALIGN, or NULL.
+void *arena_alloc(Arena *a, size_t size)
+{
+	size_t block, k = arena_class(size, &block);
+	void *p;
+
+	if (block >= ARENA_CHUNK) {
+		Arena_Chunk *c = arena_chunk(a, block);
+		if (c == NULL) return NULL;
+		c->used = block;
+		c->next = a->large;
+		a->large = c;
+		p = c->data;
+		goto done;
+	}
+	if ((p = a->free[k]) != NULL) {
+		memcpy(&a->free[k], p, sizeof(void *));
+		goto done;
+	}
+	// The current chunk first, then the first one with room left.
+	if (a->current == NULL || a->current->size - a->current->used < block) {
+		for (a->current = a->chunks; a->current; a->current = a->current->next) {
+			if (a->current->size - a->current->used >= block) break;
+		}
+	}
+	if (a->current == NULL) {
+		Arena_Chunk *c = arena_chunk(a, block);
+		if (c == NULL) return NULL;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->current = c;
+	}
+	p = a->current->data + a->current->used;
+	a->current->used += block;
+done:
+	a->live += block;
+	if (a->live > a->peak) a->peak = a->live;
+	return p;
+}
+
+// Hands a block from arena_alloc(a, size) back for reuse.
+void arena_release(Arena *a, void *p, size_t size)
+{
+	size_t block, k = arena_class(size, &block);
+	if (p == NULL) return;
+	a->live -= block;
+	if (block >= ARENA_CHUNK) {
+		for (Arena_Chunk **c = &a->large; *c; c = &(*c)->next) {
+			if ((*c)->data == p) {
+				Arena_Chunk *next = (*c)->next;
+				a->reserved -= (*c)->size;
+				free(*c);
+				*c = next;
+				return;
+			}
+		}
+		return;
+	}
+	memcpy(p, &a->free[k], sizeof(void *));
+	a->free[k] = p;
+}
+
+static void arena_free_chunks(Arena_Chunk *c)
+{
+	while (c) {
+		Arena_Chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+}
+
+// Invalidates every block but keeps the bump chunks.
+void arena_reset(Arena *a)
+{
+	for (Arena_Chunk *c = a->chunks; c; c = c->next) {
+		c->used = 0;
+	}
+	for (Arena_Chunk *c = a->large; c; c = c->next) {
+		a->reserved -= c->size;
+	}
+	arena_free_chunks(a->large);
+	a->large = NULL;
+	memset(a->free, 0, sizeof(a->free));
+	a->current = a->chunks;
+	a->live = 0;
+}
+
+void arena_free(Arena *a)
+{
+	arena_free_chunks(a->chunks);
+	arena_free_chunks(a->large);
+	memset(a, 0, sizeof(*a));
+}
+
+#endif // ARENA_C_
@@ -0,0 +1,289 @@
+// Microbenchmarks for the jgl.c primitives, headless.
+//
+// Every primitive is timed over a sweep of sizes, alphas and clip cases, and
+// every case prints one CSV row:
+//
+//   primitive,variant,size,alpha,clip,pixels,calls,ns_per_call,mpix_per_s
+//
+// `size` is the primitive's extent in pixels (a size x size box, disc, line or
+// triangle); `pixels` is how many pixels one call touches, counted by drawing
+// it once onto a cleared canvas. `clip` places the primitive wholly inside the
+// canvas, across its top-left corner (a quarter visible) or wholly outside.
+// The same call is repeated in place, so the timings are for a warm cache
+// except where the primitive is bigger than it. The color mix functions are
+// timed over a table of color pairs and count one pixel per call.
+//
+//   bench [-t ms] [-p filter]
+//
+// -t sets the minimum time spent on each case (default 10), -p runs only the
+// primitives whose name contains the filter. JGL_SIMD picks the span kernels
+// as it does for the app.
+
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#include "jgl.c"
+
+#define BENCH_W 1920
+#define BENCH_H 1080
+#define BENCH_COLOR 0x00C08040
+#define BENCH_MIX 4096
+
+static uint32_t *pixels;
+static float *depth, *hiz;
+static Canvas canvas;
+static Depth_Canvas zcanvas;
+static uint32_t mix_a[BENCH_MIX], mix_b[BENCH_MIX];
+static volatile uint32_t sink;
+static long calls;	// calls made in the current case; rising depth for the `pass` variants
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Draws the primitive with its bounding box at (x, y), s pixels on a side.
+typedef void (*Draw)(int x, int y, int s, uint32_t color);
+
+static void draw_fill(int x, int y, int s, uint32_t color)
+{
+	jgl_fill(jgl_subcanvas(canvas, x, y, s, s), color);
+}
+
+static void draw_fill_rect(int x, int y, int s, uint32_t color)
+{
+	jgl_fill_rect(canvas, x, y, s, s, color);
+}
+
+static void draw_fill_circle(int x, int y, int s, uint32_t color)
+{
+	jgl_fill_circle(canvas, x + s/2, y + s/2, s/2, color);
+}
+
+static void draw_draw_line(int x, int y, int s, uint32_t color)
+{
+	jgl_draw_line(canvas.pixels, canvas.width, canvas.height, x, y, x + s - 1, y + s/3, color);
+}
+
+static void draw_plot_line(int x, int y, int s, uint32_t color)
+{
+	jgl_plot_line(canvas, x, y, x + s - 1, y + s/3, color);
+}
+
+static void draw_fill_triangle(int x, int y, int s, uint32_t color)
+{
+	jgl_fill_triangle(canvas, x, y, x + s - 1, y + s/4, x + s/3, y + s - 1, color);
+}
+
+static void draw_triangle3c(int x, int y, int s, uint32_t color)
+{
+	uint32_t a = color & 0xFF000000;
+	jgl_triangle3c(canvas, x, y, x + s - 1, y + s/4, x + s/3, y + s - 1,
+		       a | 0xC08040, a | 0x40C080, a | 0x8040C0);
+}
+
+static void draw_triangle3z(int x, int y, int s, uint32_t color)
+{
+	float z = (float) calls;
+	(void) color;
+	jgl_triangle3z(zcanvas, x, y, x + s - 1, y + s/4, x + s/3, y + s - 1, z, z, z);
+}
+
+static void draw_fill_triangle3z(int x, int y, int s, uint32_t color)
+{
+	const int k = JGL_SUBPIXEL, h = JGL_SUBPIXEL/2;
+	float z = (float) calls;
+	jgl_fill_triangle3z_fixed(canvas, zcanvas, x*k + h, y*k + h, (x + s - 1)*k + h, (y + s/4)*k + h,
+				  (x + s/3)*k + h, (y + s - 1)*k + h, z, z, z, color);
+}
+
+typedef struct {
+	const char *name;
+	const char *variant;
+	Draw draw;
+	bool alpha;	// sweeps alpha; the others store the color as is
+	bool depth;	// counts depth buffer pixels rather than color ones
+	bool rising;	// depth rises with every call, so every pixel passes
+} Primitive;
+
+static const Primitive primitives[] = {
+	{"jgl_fill", "-", draw_fill, false, false, false},
+	{"jgl_fill_rect", "-", draw_fill_rect, true, false, false},
+	{"jgl_fill_circle", "-", draw_fill_circle, true, false, false},
+	{"jgl_draw_line", "-", draw_draw_line, false, false, false},
+	{"jgl_plot_line", "-", draw_plot_line, false, false, false},
+	{"jgl_fill_triangle", "-", draw_fill_triangle, true, false, false},
+	{"jgl_triangle3c", "-", draw_triangle3c, true, false, false},
+	{"jgl_triangle3z", "pass", draw_triangle3z, false, true, true},
+	{"jgl_triangle3z", "reject", draw_triangle3z, false, true, false},
+	{"jgl_fill_triangle3z", "pass", draw_fill_triangle3z, true, false, true},
+	{"jgl_fill_triangle3z", "reject", draw_fill_triangle3z, true, false, false},
+};
+
+static const int sizes[] = {4, 16, 64, 256, 1024};
+static const uint32_t alphas[] = {0xFF, 0x80};
+static const char *clips[] = {"inside", "edge", "outside"};
+
+static void clear(void)
+{
+	jgl_fill(canvas, 0);
+	jgl_depth_clear(zcanvas);
+}
+
+static size_t count(bool in_depth)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < (size_t) BENCH_W*BENCH_H; ++i) {
+		n += in_depth ? depth[i] != 0 : pixels[i] != 0;
+	}
+	return n;
+}
+
+static void report(const char *name, const char *variant, int size, uint32_t alpha, const char *clip, size_t px, long n, uint64_t ns)
+{
+	double per_call = (double) ns/n;
+	printf("%s,%s,%d,%u,%s,%zu,%ld,%.2f,%.2f\n", name, variant, size, alpha, clip, px, n, per_call, px*1e3/per_call);
+	fflush(stdout);
+}
+
+// Repeats the call, doubling the count until a run takes at least min_ns.
+static void run(const Primitive *p, int size, uint32_t alpha, int clip, uint64_t min_ns)
+{
+	int x = clip == 0 ? (BENCH_W - size)/2 : clip == 1 ? -size/2 : -2*size;
+	int y = clip == 0 ? (BENCH_H - size)/2 : clip == 1 ? -size/2 : -2*size;
+	uint32_t color = alpha << 24 | BENCH_COLOR;
+	uint64_t ns = 0;
+	long n;
+
+	clear();
+	calls = 1;
+	p->draw(x, y, size, color);
+	size_t px = count(p->depth);
+
+	for (n = 1;; n *= 2) {
+		clear();
+		calls = 1;
+		uint64_t t0 = now_ns();
+		for (long i = 0; i < n; ++i) {
+			if (p->rising) ++calls;
+			p->draw(x, y, size, color);
+		}
+		ns = now_ns() - t0;
+		if (ns >= min_ns) break;
+	}
+	report(p->name, p->variant, size, alpha, clips[clip], px, n, ns);
+}
+
+static uint32_t mix_blend(uint32_t a, uint32_t b)
+{
+	return blend_colors(&a, b);
+}
+
+static uint32_t mix_pair(uint32_t a, uint32_t b)
+{
+	return jgl_mix_colors(a, b);
+}
+
+static uint32_t mix_three(uint32_t a, uint32_t b)
+{
+	return mix_colors3(a, b, a ^ b, 0.5f, 0.25f, 0.25f);
+}
+
+static const struct {
+	const char *name;
+	uint32_t (*mix)(uint32_t, uint32_t);
+} mixes[] = {
+	{"blend_colors", mix_blend},
+	{"jgl_mix_colors", mix_pair},
+	{"mix_colors3", mix_three},
+};
+
+static void run_mix(const char *name, uint32_t (*mix)(uint32_t, uint32_t), uint64_t min_ns)
+{
+	uint64_t ns = 0;
+	long n;
+	for (n = 1;; n *= 2) {
+		uint32_t acc = 0;
+		uint64_t t0 = now_ns();
+		for (long k = 0; k < n; ++k) {
+			for (int i = 0; i < BENCH_MIX; ++i) acc += mix(mix_a[i], mix_b[i]);
+		}
+		ns = now_ns() - t0;
+		sink = acc;
+		if (ns >= min_ns) break;
+	}
+	report(name, "-", 1, 0, "-", 1, n*BENCH_MIX, ns);
+}
+
+// jgl_blend_span over a span of the given length, the kernel under every blended fill.
+static void run_blend_span(int size, uint64_t min_ns)
+{
+	uint64_t ns = 0;
+	long n;
+	for (n = 1;; n *= 2) {
+		uint64_t t0 = now_ns();
+		for (long i = 0; i < n; ++i) jgl_blend_span(pixels, size, 0x80000000 | BENCH_COLOR);
+		ns = now_ns() - t0;
+		if (ns >= min_ns) break;
+	}
+	report("jgl_blend_span", "-", size, 0x80, "inside", size, n, ns);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t min_ns = 10*1000000ull;
+	const char *filter = "";
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-t") && i + 1 < argc) min_ns = strtoull(argv[++i], NULL, 10)*1000000ull;
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc) filter = argv[++i];
+		else {
+			fprintf(stderr, "usage: %s [-t ms] [-p filter]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	pixels = malloc((size_t) BENCH_W*BENCH_H*sizeof(uint32_t));
+	depth = malloc((size_t) BENCH_W*BENCH_H*sizeof(float));
+	hiz = malloc(JGL_HIZ_SIZE(BENCH_W, BENCH_H)*sizeof(float));
+	if (pixels == NULL || depth == NULL || hiz == NULL) return 1;
+	canvas = jgl_canvas(pixels, BENCH_W, BENCH_H, BENCH_W);
+	zcanvas = jgl_depth_canvas(depth, hiz, BENCH_W, BENCH_H, BENCH_W);
+	srand(1);
+	for (int i = 0; i < BENCH_MIX; ++i) {
+		mix_a[i] = (uint32_t) rand() << 16 ^ (uint32_t) rand();
+		mix_b[i] = (uint32_t) rand() << 16 ^ (uint32_t) rand();
+	}
+
+	fprintf(stderr, "%s kernels, %dx%d canvas\n", jgl_init(), BENCH_W, BENCH_H);
+	printf("primitive,variant,size,alpha,clip,pixels,calls,ns_per_call,mpix_per_s\n");
+
+	for (size_t p = 0; p < sizeof(primitives)/sizeof(primitives[0]); ++p) {
+		if (!strstr(primitives[p].name, filter)) continue;
+		for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+			for (size_t a = 0; a < (primitives[p].alpha ? sizeof(alphas)/sizeof(alphas[0]) : 1); ++a) {
+				for (int c = 0; c < 3; ++c) run(&primitives[p], sizes[s], alphas[a], c, min_ns);
+			}
+		}
+	}
+	if (strstr("jgl_fill", filter)) {
+		// The whole canvas at once, which takes the streaming stores.
+		uint64_t ns = 0;
+		long n;
+		for (n = 1;; n *= 2) {
+			uint64_t t0 = now_ns();
+			for (long i = 0; i < n; ++i) jgl_fill(canvas, 0xFF000000 | BENCH_COLOR);
+			ns = now_ns() - t0;
+			if (ns >= min_ns) break;
+		}
+		report("jgl_fill", "canvas", BENCH_W, 0xFF, "inside", (size_t) BENCH_W*BENCH_H, n, ns);
+	}
+	if (strstr("jgl_blend_span", filter)) {
+		for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) run_blend_span(sizes[s], min_ns);
+	}
+	for (size_t m = 0; m < sizeof(mixes)/sizeof(mixes[0]); ++m) {
+		if (strstr(mixes[m].name, filter)) run_mix(mixes[m].name, mixes[m].mix, min_ns);
+	}
+	return 0;
+}
@@ -2,12 +2,29 @@
 
 OS=$(uname)
 
+if [ "$1" = "headless" ]; then
+	gcc -O2 -Wall -Wextra -I. -DHEADLESS -o ./bin/trinket-headless trinket.c -lm -pthread && ./bin/trinket-headless -b ${2:-300}
+	exit
+fi
+
+if [ "$1" = "golden" ]; then
+	shift
+	gcc -O2 -Wall -Wextra -I. -DHEADLESS -o ./bin/golden golden.c -lm -pthread && ./bin/golden "$@"
+	exit
+fi
+
+if [ "$1" = "bench" ]; then
+	shift
+	gcc -O2 -Wall -Wextra -I. -o ./bin/bench bench.c -lm && ./bin/bench "$@"
+	exit
+fi
+
 case $OS in
 	Linux)
-		gcc -Wall -Wextra -I. -DSDL_PLATFORM -o ./bin/trinket trinket.c -lm -lSDL2 && ./bin/trinket
+		gcc -O2 -Wall -Wextra -I. -DSDL_PLATFORM -o ./bin/trinket trinket.c -lm -pthread -lSDL2 && ./bin/trinket
 		;;
 	Darwin)
-		gcc -I/Users/lij/tools/SDL2/SDL-release-2.30.9/include -Lsrc/lib -o ./bin/trinket trinket.c -lSDL2main -lSDL2 -framework CoreVideo -framework Cocoa -framework IOKit -framework CoreAudio -framework Metal -framework AudioToolbox -framework CoreHaptics -framework GameController -framework ForceFeedback -framework Carbon -framework QuartzCore -framework AppKit -framework CoreFoundation -framework CoreGraphics -framework CoreServices -framework Foundation && ./bin/trinket
+		gcc -O2 -I/Users/lij/tools/SDL2/SDL-release-2.30.9/include -Lsrc/lib -o ./bin/trinket trinket.c -lSDL2main -lSDL2 -framework CoreVideo -framework Cocoa -framework IOKit -framework CoreAudio -framework Metal -framework AudioToolbox -framework CoreHaptics -framework GameController -framework ForceFeedback -framework Carbon -framework QuartzCore -framework AppKit -framework CoreFoundation -framework CoreGraphics -framework CoreServices -framework Foundation && ./bin/trinket
 		;;
 esac
 
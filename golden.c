@@ -0,0 +1,369 @@
+/* Golden-image and frame time regression checks, headless.
+
+   Renders a fixed set of scenes and compares each, pixel for pixel, with the
+   PPM of the same name under the reference directory (golden/ by default).
+   A scene that differs is written next to its reference as NAME.out.ppm.
+   Before the scenes, vertex welding and the arena's resident memory on a
+   large scene are checked.
+
+     golden [--update] [--perf] [-j threads] [dir]
+
+   --perf also times each scene, and jgl_fill over the whole frame, at
+   TIME_W x TIME_H and fails any whose fastest frame time is over its limit
+   in thresholds.txt. Limits are multiples of the fastest time of the C
+   library's memset over the same frame, measured in the same run: nothing
+   in jgl or trinket can slow it down, and it carries over to a slower or
+   faster machine better than milliseconds would. A limit left
+   out of thresholds.txt is not checked. --update rewrites the references
+   from the current tree, leaving thresholds.txt alone; with --perf it
+   prints the measured multiples. Images are rendered small to keep the
+   references small; focal length follows the frame width, so they show the
+   same view as the timed frames. */
+
+#define TRINKET_NO_MAIN
+#include "trinket.c"
+
+#define GOLD_W 256
+#define GOLD_H 160
+#define TIME_W 1536
+#define TIME_H 960
+#define TIME_WARMUP 5
+#define TIME_FRAMES 63
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*draw)(Canvas c);
+} Golden;
+
+/* Scenes built by trinket and drawn through render(). */
+
+static void camera(float pitch, float yaw, float range)
+{
+    cam.range = range;
+    set3d(&cam.rotation, pitch, yaw, 0);
+    cam.trotation = cam.rotation;
+}
+
+static void setup_box(void)
+{
+    setup(0, 0);
+    camera(190, 30, 30);
+    solid = hidden = 0;
+}
+
+static void setup_grid(void)
+{
+    setup(24, 0);
+    camera(170, 15, 35);
+    solid = hidden = 0;
+}
+
+static void setup_grid_solid(void)
+{
+    setup_grid();
+    solid = 1;
+}
+
+static void setup_grid_hidden(void)
+{
+    setup_grid();
+    hidden = 1;
+}
+
+/* Mirrored after its first frame, once its faces were turned outward. */
+static void setup_box_mirrored(void)
+{
+    setup_box();
+    hidden = 1;
+    render(jgl_canvas(pixels, width, height, screen_w));
+    scale(scene.meshes[0], -1, 1, 1);
+}
+
+static void draw_scene(Canvas c)
+{
+    render(c);
+}
+
+/* Scenes drawn straight with jgl, laid out in fractions of the canvas. */
+
+static void setup_none(void)
+{
+}
+
+/* Timed against the reference below, like the scenes. */
+static void draw_fill(Canvas c)
+{
+    jgl_fill(c, 0xff000000);
+}
+
+/* The baseline thresholds.txt is relative to: the C library's memset over
+   the frame, which nothing in jgl or trinket can slow down. */
+static void draw_reference(Canvas c)
+{
+    size_t y;
+    for (y = 0; y < c.height; y++)
+        memset(&PIXEL(c, 0, y), (int)y, c.width * sizeof(uint32_t));
+}
+
+#define AT(c, f) ((int)((f) * (c).width))
+#define AT_Y(c, f) ((int)((f) * (c).height))
+
+static void draw_triangles(Canvas c)
+{
+    int i, j, n = 8;
+    jgl_fill(c, 0xff202020);
+    for (j = 0; j < n/2; j++) {
+        for (i = 0; i < n; i++) {
+            float x0 = (float)i / n, y0 = (float)j / (n/2), x1 = (float)(i + 1) / n, y1 = (float)(j + 1) / (n/2);
+            uint32_t a = (i + j) % 2 ? 0x80000000 : 0xff000000;
+            jgl_triangle3c(c, AT(c, x0), AT_Y(c, y0), AT(c, x1), AT_Y(c, y0), AT(c, x0), AT_Y(c, y1),
+                           a | 0x0000ff, a | 0x00ff00, a | 0xff0000);
+            jgl_triangle3c(c, AT(c, x1), AT_Y(c, y0), AT(c, x1), AT_Y(c, y1), AT(c, x0), AT_Y(c, y1),
+                           a | 0xffff00, a | 0x00ffff, a | 0xff00ff);
+        }
+    }
+    /* Larger than the canvas on two sides, to cover clipping. */
+    jgl_triangle3c(c, AT(c, -0.2f), AT_Y(c, 0.3f), AT(c, 0.6f), AT_Y(c, -0.3f), AT(c, 0.9f), AT_Y(c, 1.4f),
+                   0x80ffffff, 0x80000000, 0x8040c0ff);
+}
+
+static void draw_overlaps(Canvas c)
+{
+    int i;
+    jgl_fill(c, 0xff101010);
+    for (i = 0; i < 6; i++) {
+        uint32_t a = (uint32_t)(0x40 + 0x20*i) << 24;
+        float f = i / 6.0f;
+        jgl_fill_rect(c, AT(c, 0.05f + 0.1f*f), AT_Y(c, 0.1f + 0.5f*f), AT(c, 0.4f), AT_Y(c, 0.3f), a | 0x2040ff);
+        jgl_fill_circle(c, AT(c, 0.55f + 0.2f*f), AT_Y(c, 0.5f), AT_Y(c, 0.25f), a | 0xff8020);
+        jgl_fill_triangle(c, AT(c, 0.3f + 0.1f*f), AT_Y(c, 0.9f), AT(c, 0.7f), AT_Y(c, 0.1f + 0.1f*f), AT(c, 1.1f), AT_Y(c, 0.8f), a | 0x20ff40);
+        jgl_plot_line(c, AT(c, -0.1f), AT_Y(c, f), AT(c, 1.1f), AT_Y(c, 1 - f), a | 0xffffff);
+    }
+}
+
+static const Golden goldens[] = {
+    {"box", setup_box, draw_scene},
+    {"box-mirrored", setup_box_mirrored, draw_scene},
+    {"grid", setup_grid, draw_scene},
+    {"grid-solid", setup_grid_solid, draw_scene},
+    {"grid-hidden", setup_grid_hidden, draw_scene},
+    {"triangles", setup_none, draw_triangles},
+    {"overlaps", setup_none, draw_overlaps},
+};
+
+/* Vertex welding: with an epsilon, vertices closer than it on every axis
+   merge, also across the hash's grid cell edges; without, only exact
+   duplicates do. Returns the number of failed checks. */
+static int check_weld(void)
+{
+    static const struct { float epsilon, x, y; int same; } cases[] = {
+        {0, 0.0095f, 0, 0},
+        {0, 0.0100f, 0, 1},
+        {0.01f, 0.0095f, 0, 1},     /* another cell */
+        {0.01f, 0.0100f, 0.0040f, 1},
+        {0.01f, 0.0100f, 0.0210f, 0},
+        {0.01f, 0.0210f, 0, 0},
+    };
+    int i, failed = 0;
+    for (i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++) {
+        Mesh *m;
+        uint32_t a, b;
+        setup(0, cases[i].epsilon);
+        m = addmesh(&scene);
+        a = addvertex(m, 0.0100f, 0, 0);
+        b = addvertex(m, cases[i].x, cases[i].y, 0);
+        if ((a == b) != cases[i].same) {
+            printf("weld         FAIL (%g, %g, 0) %s (0.01, 0, 0) at epsilon %g\n", cases[i].x, cases[i].y,
+                   cases[i].same ? "not merged with" : "merged with", cases[i].epsilon);
+            failed++;
+        }
+    }
+    if (!failed) printf("weld         ok\n");
+    return failed;
+}
+
+/* Arena residency: a scene of large meshes, grown by doubling, must not
+   keep much more memory from the system than it ever had in use. */
+#define ARENA_MESHES 40
+#define ARENA_SEGS 3000
+
+static int check_arena(void)
+{
+    double ratio;
+    int i;
+    setup(0, 0);
+    for (i = 0; i < ARENA_MESHES; i++)
+        extrude(createplane(&scene, 60, 60, ARENA_SEGS + 7*i, ARENA_SEGS, 0xff808080), 0, 0, 5, 0xff808080);
+    ratio = (double)arena.reserved / arena.peak;
+    printf("arena        %s %.1f MiB reserved for a %.1f MiB peak (%.2fx, limit 1.15x)\n", ratio > 1.15 ? "FAIL" : "ok",
+           arena.reserved / 1048576.0, arena.peak / 1048576.0, ratio);
+    return ratio > 1.15;
+}
+
+/* Harness */
+
+static Canvas sized(int w, int h)
+{
+    setsize(w, h);
+    return jgl_canvas(pixels, w, h, screen_w);
+}
+
+/* The fastest of TIME_FRAMES frames: other load on the machine only ever
+   adds time, so it varies far less from run to run than the median. */
+static uint64_t fastest_ns(const Golden *g)
+{
+    uint64_t best = UINT64_MAX;
+    Canvas c = sized(TIME_W, TIME_H);
+    int i;
+    for (i = 0; i < TIME_WARMUP; i++)
+        g->draw(c);
+    for (i = 0; i < TIME_FRAMES; i++) {
+        uint64_t t0 = now_ns();
+        g->draw(c);
+        t0 = now_ns() - t0;
+        if (t0 < best) best = t0;
+    }
+    return best;
+}
+
+/* The frame as the PPM would hold it, 0x00BBGGRR, rows packed. */
+static uint32_t *image(const Golden *g)
+{
+    uint32_t *img = malloc((size_t)GOLD_W*GOLD_H * sizeof(uint32_t));
+    int y;
+    if (img == NULL) abort();
+    g->draw(sized(GOLD_W, GOLD_H));
+    for (y = 0; y < GOLD_H; y++)
+        memcpy(&img[y*GOLD_W], &pixels[y*screen_w], GOLD_W * sizeof(uint32_t));
+    for (y = 0; y < GOLD_W*GOLD_H; y++)
+        img[y] &= 0x00ffffff;
+    return img;
+}
+
+/* Reads a w x h binary PPM written by jgl_save_to_ppm(); NULL when it is
+   missing or another size. */
+static uint32_t *load_ppm(const char *path, int w, int h)
+{
+    FILE *f = fopen(path, "rb");
+    uint32_t *img = NULL;
+    int fw, fh, max, i;
+    if (f == NULL) return NULL;
+    if (fscanf(f, "P6 %d %d %d", &fw, &fh, &max) == 3 && fgetc(f) != EOF && fw == w && fh == h && max == 255
+        && (img = malloc((size_t)w*h * sizeof(uint32_t))) != NULL) {
+        for (i = 0; i < w*h; i++) {
+            uint8_t rgb[3];
+            if (fread(rgb, sizeof(rgb), 1, f) != 1) {
+                free(img);
+                img = NULL;
+                break;
+            }
+            img[i] = rgb[0] | rgb[1] << 8 | (uint32_t)rgb[2] << 16;
+        }
+    }
+    fclose(f);
+    return img;
+}
+
+/* Frame time limit for the scene as a multiple of the reference time, 0
+   when none is set. Lines are "name multiple"; anything after a # is ignored. */
+static double threshold(const char *dir, const char *name)
+{
+    char path[512], line[256], key[128];
+    double x, limit = 0;
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/thresholds.txt", dir);
+    if ((f = fopen(path, "r")) == NULL) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        if (sscanf(line, "%127s %lf", key, &x) == 2 && !strcmp(key, name)) limit = x;
+    }
+    fclose(f);
+    return limit;
+}
+
+int main(int argc, char *argv[])
+{
+    static const Golden reference = {"reference", setup_none, draw_reference};
+    static const Golden fill = {"fill", setup_none, draw_fill};
+    const char *dir = "golden";
+    int i, update = 0, perf = 0, failed = 0;
+    double base = 0;
+    char path[512];
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--update"))
+            update = 1;
+        else if (!strcmp(argv[i], "--perf"))
+            perf = 1;
+        else if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--threads")) && i+1 < argc)
+            threads = atoi(argv[++i]);
+        else if (argv[i][0] != '-')
+            dir = argv[i];
+        else {
+            fprintf(stderr, "usage: %s [--update] [--perf] [-j threads] [dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    jgl_init();
+    startpool();
+    allocscreen(TIME_W, TIME_H);
+    failed += check_weld() != 0;
+    failed += check_arena();
+    if (perf) {
+        double ms, limit = threshold(dir, fill.name);
+        int slow;
+        base = fastest_ns(&reference) / 1e6;
+        printf("%-12s fastest %.3f ms at %dx%d\n", reference.name, base, TIME_W, TIME_H);
+        ms = fastest_ns(&fill) / 1e6;
+        slow = !update && limit > 0 && ms > limit * base;
+        printf("%-12s %s fastest %.3f ms, %.2fx reference", fill.name, slow ? "FAIL" : "ok", ms, ms / base);
+        if (!update && limit > 0) printf(" (limit %.2fx%s)", limit, slow ? ", too slow" : "");
+        printf("\n");
+        failed += slow;
+    }
+
+    for (i = 0; i < (int)(sizeof(goldens)/sizeof(goldens[0])); i++) {
+        const Golden *g = &goldens[i];
+        g->setup();
+        double ms = perf ? fastest_ns(g) / 1e6 : 0, limit = perf ? threshold(dir, g->name) : 0;
+        uint32_t *img = image(g), *ref;
+        int k, diff = 0, slow;
+
+        snprintf(path, sizeof(path), "%s/%s.ppm", dir, g->name);
+        if (update) {
+            if (jgl_save_to_ppm(img, GOLD_W, GOLD_H, path) != 0) {
+                perror(path);
+                failed++;
+            }
+            printf("%-12s written", g->name);
+            if (perf) printf(", fastest %.3f ms, %.2fx reference", ms, ms / base);
+            printf("\n");
+            free(img);
+            continue;
+        }
+        if ((ref = load_ppm(path, GOLD_W, GOLD_H)) == NULL) {
+            printf("%-12s FAIL no %dx%d reference at %s\n", g->name, GOLD_W, GOLD_H, path);
+            failed++;
+            free(img);
+            continue;
+        }
+        for (k = 0; k < GOLD_W*GOLD_H; k++)
+            diff += img[k] != ref[k];
+        if (diff) {
+            snprintf(path, sizeof(path), "%s/%s.out.ppm", dir, g->name);
+            jgl_save_to_ppm(img, GOLD_W, GOLD_H, path);
+        }
+        slow = limit > 0 && ms > limit * base;
+        printf("%-12s %s %d pixels differ", g->name, diff || slow ? "FAIL" : "ok", diff);
+        if (perf) printf(", fastest %.3f ms, %.2fx reference", ms, ms / base);
+        if (limit > 0) printf(" (limit %.2fx%s)", limit, slow ? ", too slow" : "");
+        printf("\n");
+        failed += diff || slow;
+        free(ref);
+        free(img);
+    }
+    printf("%d thread%s, %s kernels: %s\n", threads, threads > 1 ? "s" : "", jgl_kernels.name, failed ? "FAILED" : "passed");
+    return failed != 0;
+}
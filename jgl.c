@@ -9,6 +9,13 @@
 #include <math.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define JGL_X86
+#include <immintrin.h>
+#endif
 
 typedef struct {
 	uint32_t *pixels;
@@ -30,6 +37,86 @@ Canvas jgl_canvas(uint32_t *pixels, size_t width, size_t height, size_t stride)
 	return c;
 }
 
+// Clamps the w x h box at (*x, *y) to a width x height canvas.
+static void jgl_clip_window(size_t width, size_t height, int *x, int *y, size_t *w, size_t *h)
+{
+	int x1 = *x + (int) *w, y1 = *y + (int) *h;
+	if (*x < 0) *x = 0;
+	if (*y < 0) *y = 0;
+	if (x1 > (int) width) x1 = (int) width;
+	if (y1 > (int) height) y1 = (int) height;
+	if (x1 < *x) x1 = *x;
+	if (y1 < *y) y1 = *y;
+	*w = x1 - *x;
+	*h = y1 - *y;
+}
+
+// A w x h window into c at (x, y), clamped to c. It shares c's pixels and
+// stride, so anything drawn into it lands in c, offset by (x, y) and clipped
+// to the window.
+Canvas jgl_subcanvas(Canvas c, int x, int y, size_t w, size_t h)
+{
+	jgl_clip_window(c.width, c.height, &x, &y, &w, &h);
+	return jgl_canvas(&PIXEL(c, x, y), w, h, c.stride);
+}
+
+// Depth buffer for the depth-tested primitives. Depth is reciprocal distance
+// (1/w), which interpolates linearly in screen space: bigger is nearer and a
+// cleared buffer holds 0. `hiz` is optional and holds, for every JGL_HIZ-pixel
+// segment of a row, a depth no nearer than any pixel in it; a span that is not
+// nearer than that anywhere is dropped without touching the depth buffer.
+// Segments are aligned to the canvas `hiz` was made for, so sub-canvases that
+// start on segment boundaries never share one and can be drawn in parallel.
+typedef struct {
+	float *depth;
+	float *hiz;
+	size_t width;
+	size_t height;
+	size_t stride;
+	size_t hiz_stride;
+	size_t hiz_phase;	// column 0's offset into its segment
+} Depth_Canvas;
+
+#define JGL_HIZ 8
+#define JGL_HIZ_SIZE(width, height) ((((width) + JGL_HIZ - 1)/JGL_HIZ)*(height))
+#define DEPTH(d, x, y) (d).depth[(y)*(d).stride + (x)]
+
+// `hiz` may be NULL, or hold JGL_HIZ_SIZE(width, height) floats.
+Depth_Canvas jgl_depth_canvas(float *depth, float *hiz, size_t width, size_t height, size_t stride)
+{
+	Depth_Canvas d = {
+		.depth = depth,
+		.hiz = hiz,
+		.width = width,
+		.height = height,
+		.stride = stride,
+		.hiz_stride = (width + JGL_HIZ - 1)/JGL_HIZ,
+		.hiz_phase = 0,
+	};
+	return d;
+}
+
+Depth_Canvas jgl_depth_subcanvas(Depth_Canvas d, int x, int y, size_t w, size_t h)
+{
+	Depth_Canvas s = d;
+	jgl_clip_window(d.width, d.height, &x, &y, &w, &h);
+	s.depth = &DEPTH(d, x, y);
+	if (d.hiz) s.hiz = d.hiz + y*d.hiz_stride + (d.hiz_phase + x)/JGL_HIZ;
+	s.hiz_phase = (d.hiz_phase + x) % JGL_HIZ;
+	s.width = w;
+	s.height = h;
+	return s;
+}
+
+void jgl_depth_clear(Depth_Canvas d)
+{
+	size_t segments = (d.hiz_phase + d.width + JGL_HIZ - 1)/JGL_HIZ;
+	for (size_t y = 0; y < d.height; ++y) {
+		memset(&DEPTH(d, 0, y), 0, d.width*sizeof(float));
+		if (d.hiz) memset(d.hiz + y*d.hiz_stride, 0, segments*sizeof(float));
+	}
+}
+
 typedef enum {
 	COMP_RED = 0,
 	COMP_GREEN,
@@ -85,6 +172,7 @@ uint32_t blend_colors(uint32_t *c1, uint32_t c2)
 	b1 = (b1*(255-a2) + b2*a2)/255; if (b1 > 255) b1 = 255;
 
 	*c1 = JGL_RGBA(r1, g1, b1, a1);
+	return *c1;
 }
 
 uint32_t jgl_mix_colors(uint32_t c1, uint32_t c2)
@@ -129,70 +217,469 @@ uint32_t mix_colors3(uint32_t c1, uint32_t c2, uint32_t c3, float t1, float t2,
 	return JGL_RGBA(r4, g4, b4, a4);
 }
 
-void jgl_fill(Canvas c, uint32_t color)
+// Span kernels. The widest variant the CPU supports is picked once by jgl_init(),
+// which runs on first use; set JGL_SIMD=scalar|sse2|avx2|avx512 to force one.
+// `stream` uses non-temporal stores and is meant for spans much larger than the cache.
+// `blend` is blend_colors() over a span and gives bit-identical results: each channel
+// is widened to 16 bits, d*(255-a) + s*a is at most 65025, and x/255 is computed
+// exactly as (x + 1 + (x>>8)) >> 8 for that range. Destination alpha is kept by
+// weighting it with 255 and adding nothing.
+// `opaque` is `blend` for alpha 0xFF: it stores the color's RGB and keeps destination alpha.
+// `shade` writes a Gouraud span: pixel i has channels (v[k] + i*dv[k]) >> 16, clamped to
+// 0..255, and is stored like `opaque` or blended like `blend`. Its SIMD form keeps the
+// four channels of one pixel in a 128-bit register, so the wider tables share it.
+
+#define JGL_STREAM_MIN (1<<20)
+
+typedef struct {
+	const char *name;
+	void (*fill)(uint32_t *dst, size_t n, uint32_t color);
+	void (*stream)(uint32_t *dst, size_t n, uint32_t color);
+	void (*blend)(uint32_t *dst, size_t n, uint32_t color);
+	void (*opaque)(uint32_t *dst, size_t n, uint32_t color);
+	void (*shade)(uint32_t *dst, size_t n, const int32_t v[COUNT_COMPS], const int32_t dv[COUNT_COMPS], bool opaque);
+} Jgl_Kernels;
+
+static void jgl_fill_span_scalar(uint32_t *dst, size_t n, uint32_t color)
 {
-	for (size_t y = 0; y < c.height; ++y) {
-		for (size_t x = 0; x < c.width; ++x) {
-			PIXEL(c, x, y) = color;
-		}
+	for (size_t i = 0; i < n; ++i) {
+		dst[i] = color;
 	}
 }
 
-void jgl_fill_rect(Canvas c, int x0, int y0, size_t w, size_t h, uint32_t color)
+static void jgl_blend_span_scalar(uint32_t *dst, size_t n, uint32_t color)
 {
-	for (int dy = 0; dy < (int) h; ++dy) {
-		int y = y0 + dy;
-		if (0 <= y && y < (int) c.height) {
-			for(int dx = 0; dx < (int) w; ++dx) {
-				int x = x0 + dx;
-				if (0 <= x && x < (int) c.width) {
-					blend_colors(&PIXEL(c, x, y), color);
-				}
-			}
-		}
+	for (size_t i = 0; i < n; ++i) {
+		blend_colors(&dst[i], color);
 	}
 }
 
-void jgl_fill_circle(Canvas c, int cx, int cy, size_t r, uint32_t color)
+static void jgl_opaque_span_scalar(uint32_t *dst, size_t n, uint32_t color)
 {
-	int x1 = cx - (int) r;
-	int y1 = cy - (int) r;
-	int x2 = cx + (int) r;
-	int y2 = cy + (int) r;
-	for (int y = y1; y <= y2; ++y) {
-		if (0 <= y && y < (int) c.height) {
-			for (int x = x1; x <= x2; ++x) {
-				if (0 <= x && x < (int) c.width) {
-					int dx = x - cx;
-					int dy = y - cy;
-					if (dx*dx + dy*dy <= (int) r * (int) r) {
-						blend_colors(&PIXEL(c, x, y), color);
-					}
-				}
-			}
+	for (size_t i = 0; i < n; ++i) {
+		dst[i] = (dst[i] & 0xFF000000) | (color & 0x00FFFFFF);
+	}
+}
+
+static void jgl_shade_span_scalar(uint32_t *dst, size_t n, const int32_t v[COUNT_COMPS], const int32_t dv[COUNT_COMPS], bool opaque)
+{
+	int32_t x[COUNT_COMPS];
+	memcpy(x, v, sizeof(x));
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t color = 0;
+		for (int k = 0; k < COUNT_COMPS; ++k) {
+			int32_t c = x[k] >> 16;
+			color |= (uint32_t) (c < 0 ? 0 : c > 255 ? 255 : c) << (8*k);
+			x[k] += dv[k];
 		}
+		if (opaque) dst[i] = (dst[i] & 0xFF000000) | (color & 0x00FFFFFF);
+		else blend_colors(&dst[i], color);
 	}
 }
 
-void jgl_circlez(Canvas c, int cx, int cy, size_t r, float z)
+#ifdef JGL_X86
+
+__attribute__((target("sse2")))
+static void jgl_fill_span_sse2(uint32_t *dst, size_t n, uint32_t color)
 {
-    int x1 = cx - (int) r;
-	int y1 = cy - (int) r;
-	int x2 = cx + (int) r;
-	int y2 = cy + (int) r;
-	for (int y = y1; y <= y2; ++y) {
-		if (0 <= y && y < (int) c.height) {
-			for (int x = x1; x <= x2; ++x) {
-				if (0 <= x && x < (int) c.width) {
-					int dx = x - cx;
-					int dy = y - cy;
-					if (dx*dx + dy*dy <= (int) r * (int) r) {
-					    PIXEL(c, x, y) = *(uint32_t*)&z;
-					}
-				}
-			}
+	__m128i v = _mm_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i *) (dst + i), v);
+	for (; i < n; ++i) dst[i] = color;
+}
+
+__attribute__((target("sse2")))
+static void jgl_stream_span_sse2(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m128i v = _mm_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i < n && ((uintptr_t) (dst + i) & 15); ++i) dst[i] = color;
+	for (; i + 4 <= n; i += 4) _mm_stream_si128((__m128i *) (dst + i), v);
+	for (; i < n; ++i) dst[i] = color;
+	_mm_sfence();
+}
+
+#define JGL_BLEND_WEIGHTS(color) \
+	uint32_t a = JGL_ALPHA(color); \
+	uint64_t inv4 = (uint64_t) (255 - a) * 0x0000000100010001ull | 255ull << 48; \
+	uint64_t src4 = (uint64_t) (JGL_RED(color)*a) | (uint64_t) (JGL_GREEN(color)*a) << 16 | (uint64_t) (JGL_BLUE(color)*a) << 32
+
+__attribute__((target("sse2")))
+static inline __m128i jgl_blend_128(__m128i d, __m128i inv, __m128i src)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv), src);
+	__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv), src);
+	__m128i one = _mm_set1_epi16(1);
+	lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+	return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("sse2")))
+static void jgl_blend_span_sse2(uint32_t *dst, size_t n, uint32_t color)
+{
+	JGL_BLEND_WEIGHTS(color);
+	__m128i inv = _mm_set1_epi64x((long long) inv4);
+	__m128i src = _mm_set1_epi64x((long long) src4);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), jgl_blend_128(d, inv, src));
+	}
+	for (; i < n; ++i) blend_colors(&dst[i], color);
+}
+
+// Four 16.16 pixels to 8-bit; the saturating packs do the clamping.
+__attribute__((target("sse2")))
+static inline __m128i jgl_shade_128(__m128i x0, __m128i x1, __m128i x2, __m128i x3)
+{
+	__m128i lo = _mm_packs_epi32(_mm_srai_epi32(x0, 16), _mm_srai_epi32(x1, 16));
+	__m128i hi = _mm_packs_epi32(_mm_srai_epi32(x2, 16), _mm_srai_epi32(x3, 16));
+	return _mm_packus_epi16(lo, hi);
+}
+
+// jgl_blend_128() with each pixel's weights taken from its own alpha.
+__attribute__((target("sse2")))
+static inline __m128i jgl_blend_each_128(__m128i d, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i one = _mm_set1_epi16(1);
+	__m128i full = _mm_set1_epi16(255);
+	__m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i half[2];
+	for (int h = 0; h < 2; ++h) {
+		__m128i s = h ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+		__m128i t = h ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+		__m128i a = _mm_andnot_si128(alpha, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF));
+		__m128i x = _mm_add_epi16(_mm_mullo_epi16(t, _mm_sub_epi16(full, a)), _mm_mullo_epi16(s, a));
+		half[h] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, one), _mm_srli_epi16(x, 8)), 8);
+	}
+	return _mm_packus_epi16(half[0], half[1]);
+}
+
+__attribute__((target("sse2")))
+static void jgl_shade_span_sse2(uint32_t *dst, size_t n, const int32_t v[COUNT_COMPS], const int32_t dv[COUNT_COMPS], bool opaque)
+{
+	__m128i step = _mm_loadu_si128((const __m128i *) dv);
+	__m128i step4 = _mm_slli_epi32(step, 2);
+	__m128i x0 = _mm_loadu_si128((const __m128i *) v);
+	__m128i x1 = _mm_add_epi32(x0, step);
+	__m128i x2 = _mm_add_epi32(x1, step);
+	__m128i x3 = _mm_add_epi32(x2, step);
+	__m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i c = jgl_shade_128(x0, x1, x2, x3);
+		__m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+		d = opaque ? _mm_or_si128(_mm_and_si128(d, alpha), _mm_andnot_si128(alpha, c)) : jgl_blend_each_128(d, c);
+		_mm_storeu_si128((__m128i *) (dst + i), d);
+		x0 = _mm_add_epi32(x0, step4);
+		x1 = _mm_add_epi32(x1, step4);
+		x2 = _mm_add_epi32(x2, step4);
+		x3 = _mm_add_epi32(x3, step4);
+	}
+	for (; i < n; ++i) {
+		uint32_t color = (uint32_t) _mm_cvtsi128_si32(jgl_shade_128(x0, x0, x0, x0));
+		if (opaque) dst[i] = (dst[i] & 0xFF000000) | (color & 0x00FFFFFF);
+		else blend_colors(&dst[i], color);
+		x0 = _mm_add_epi32(x0, step);
+	}
+}
+
+__attribute__((target("sse2")))
+static void jgl_opaque_span_sse2(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m128i rgb = _mm_set1_epi32((int) (color & 0x00FFFFFF));
+	__m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_and_si128(d, alpha), rgb));
+	}
+	for (; i < n; ++i) dst[i] = (dst[i] & 0xFF000000) | (color & 0x00FFFFFF);
+}
+
+__attribute__((target("avx2")))
+static void jgl_fill_span_avx2(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m256i v = _mm256_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i *) (dst + i), v);
+	for (; i < n; ++i) dst[i] = color;
+}
+
+__attribute__((target("avx2")))
+static void jgl_stream_span_avx2(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m256i v = _mm256_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i < n && ((uintptr_t) (dst + i) & 31); ++i) dst[i] = color;
+	for (; i + 8 <= n; i += 8) _mm256_stream_si256((__m256i *) (dst + i), v);
+	for (; i < n; ++i) dst[i] = color;
+	_mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void jgl_blend_span_avx2(uint32_t *dst, size_t n, uint32_t color)
+{
+	JGL_BLEND_WEIGHTS(color);
+	__m256i inv = _mm256_set1_epi64x((long long) inv4);
+	__m256i src = _mm256_set1_epi64x((long long) src4);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i one = _mm256_set1_epi16(1);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv), src);
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv), src);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)), 8);
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_packus_epi16(lo, hi));
+	}
+	if (i + 4 <= n) {
+		__m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), jgl_blend_128(d, _mm256_castsi256_si128(inv), _mm256_castsi256_si128(src)));
+		i += 4;
+	}
+	for (; i < n; ++i) blend_colors(&dst[i], color);
+}
+
+__attribute__((target("avx2")))
+static void jgl_opaque_span_avx2(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m256i rgb = _mm256_set1_epi32((int) (color & 0x00FFFFFF));
+	__m256i alpha = _mm256_set1_epi32((int) 0xFF000000);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(_mm256_and_si256(d, alpha), rgb));
+	}
+	for (; i < n; ++i) dst[i] = (dst[i] & 0xFF000000) | (color & 0x00FFFFFF);
+}
+
+__attribute__((target("avx512f")))
+static void jgl_fill_span_avx512(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m512i v = _mm512_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) _mm512_storeu_si512(dst + i, v);
+	if (i < n) _mm512_mask_storeu_epi32(dst + i, (__mmask16) ((1u << (n - i)) - 1), v);
+}
+
+__attribute__((target("avx512f")))
+static void jgl_stream_span_avx512(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m512i v = _mm512_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i < n && ((uintptr_t) (dst + i) & 63); ++i) dst[i] = color;
+	for (; i + 16 <= n; i += 16) _mm512_stream_si512((__m512i *) (dst + i), v);
+	for (; i < n; ++i) dst[i] = color;
+	_mm_sfence();
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void jgl_blend_span_avx512(uint32_t *dst, size_t n, uint32_t color)
+{
+	JGL_BLEND_WEIGHTS(color);
+	__m512i inv = _mm512_set1_epi64((long long) inv4);
+	__m512i src = _mm512_set1_epi64((long long) src4);
+	__m512i zero = _mm512_setzero_si512();
+	__m512i one = _mm512_set1_epi16(1);
+	for (size_t i = 0; i < n; i += 16) {
+		__mmask16 m = n - i >= 16 ? 0xFFFF : (__mmask16) ((1u << (n - i)) - 1);
+		__m512i d = _mm512_maskz_loadu_epi32(m, dst + i);
+		__m512i lo = _mm512_add_epi16(_mm512_mullo_epi16(_mm512_unpacklo_epi8(d, zero), inv), src);
+		__m512i hi = _mm512_add_epi16(_mm512_mullo_epi16(_mm512_unpackhi_epi8(d, zero), inv), src);
+		lo = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(lo, one), _mm512_srli_epi16(lo, 8)), 8);
+		hi = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(hi, one), _mm512_srli_epi16(hi, 8)), 8);
+		_mm512_mask_storeu_epi32(dst + i, m, _mm512_packus_epi16(lo, hi));
+	}
+}
+
+// A byte-masked store writes RGB without reading the destination at all.
+__attribute__((target("avx512f,avx512bw")))
+static void jgl_opaque_span_avx512(uint32_t *dst, size_t n, uint32_t color)
+{
+	__m512i v = _mm512_set1_epi32((int) color);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) _mm512_mask_storeu_epi8(dst + i, 0x7777777777777777ull, v);
+	if (i < n) _mm512_mask_storeu_epi8(dst + i, 0x7777777777777777ull & ((1ull << 4*(n - i)) - 1), v);
+}
+
+#endif // JGL_X86
+
+static Jgl_Kernels jgl_kernel_table[] = {
+#ifdef JGL_X86
+	{"avx512", jgl_fill_span_avx512, jgl_stream_span_avx512, jgl_blend_span_avx512, jgl_opaque_span_avx512, jgl_shade_span_sse2},
+	{"avx2", jgl_fill_span_avx2, jgl_stream_span_avx2, jgl_blend_span_avx2, jgl_opaque_span_avx2, jgl_shade_span_sse2},
+	{"sse2", jgl_fill_span_sse2, jgl_stream_span_sse2, jgl_blend_span_sse2, jgl_opaque_span_sse2, jgl_shade_span_sse2},
+#endif
+	{"scalar", jgl_fill_span_scalar, jgl_fill_span_scalar, jgl_blend_span_scalar, jgl_opaque_span_scalar, jgl_shade_span_scalar},
+};
+
+#define JGL_KERNEL_COUNT (sizeof(jgl_kernel_table)/sizeof(jgl_kernel_table[0]))
+
+static bool jgl_kernel_supported(const Jgl_Kernels *k)
+{
+#ifdef JGL_X86
+	if (strcmp(k->name, "avx512") == 0) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	if (strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+	if (strcmp(k->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+	return strcmp(k->name, "scalar") == 0;
+}
+
+static void jgl_fill_span_init(uint32_t *dst, size_t n, uint32_t color);
+static void jgl_stream_span_init(uint32_t *dst, size_t n, uint32_t color);
+static void jgl_blend_span_init(uint32_t *dst, size_t n, uint32_t color);
+static void jgl_opaque_span_init(uint32_t *dst, size_t n, uint32_t color);
+static void jgl_shade_span_init(uint32_t *dst, size_t n, const int32_t v[COUNT_COMPS], const int32_t dv[COUNT_COMPS], bool opaque);
+
+static Jgl_Kernels jgl_kernels = {"unresolved", jgl_fill_span_init, jgl_stream_span_init, jgl_blend_span_init, jgl_opaque_span_init, jgl_shade_span_init};
+
+const char *jgl_init(void)
+{
+	const char *force = getenv("JGL_SIMD");
+#ifdef JGL_X86
+	__builtin_cpu_init();
+#endif
+	for (size_t i = 0; i < JGL_KERNEL_COUNT; ++i) {
+		if (force && strcmp(force, jgl_kernel_table[i].name) != 0) continue;
+		if (jgl_kernel_supported(&jgl_kernel_table[i])) {
+			jgl_kernels = jgl_kernel_table[i];
+			return jgl_kernels.name;
 		}
 	}
+	jgl_kernels = jgl_kernel_table[JGL_KERNEL_COUNT - 1];
+	return jgl_kernels.name;
+}
+
+static void jgl_fill_span_init(uint32_t *dst, size_t n, uint32_t color)
+{
+	jgl_init();
+	jgl_kernels.fill(dst, n, color);
+}
+
+static void jgl_stream_span_init(uint32_t *dst, size_t n, uint32_t color)
+{
+	jgl_init();
+	jgl_kernels.stream(dst, n, color);
+}
+
+static void jgl_blend_span_init(uint32_t *dst, size_t n, uint32_t color)
+{
+	jgl_init();
+	jgl_kernels.blend(dst, n, color);
+}
+
+static void jgl_opaque_span_init(uint32_t *dst, size_t n, uint32_t color)
+{
+	jgl_init();
+	jgl_kernels.opaque(dst, n, color);
+}
+
+static void jgl_shade_span_init(uint32_t *dst, size_t n, const int32_t v[COUNT_COMPS], const int32_t dv[COUNT_COMPS], bool opaque)
+{
+	jgl_init();
+	jgl_kernels.shade(dst, n, v, dv, opaque);
+}
+
+void jgl_blend_span(uint32_t *dst, size_t n, uint32_t color)
+{
+	jgl_kernels.blend(dst, n, color);
+}
+
+void jgl_fill(Canvas c, uint32_t color)
+{
+	if (c.stride == c.width) {
+		size_t n = c.width*c.height;
+		if (n*sizeof(uint32_t) >= JGL_STREAM_MIN) jgl_kernels.stream(c.pixels, n, color);
+		else jgl_kernels.fill(c.pixels, n, color);
+		return;
+	}
+	for (size_t y = 0; y < c.height; ++y) {
+		jgl_kernels.fill(&PIXEL(c, 0, y), c.width, color);
+	}
+}
+
+// Clips [x0, x1) to the canvas width; false when nothing is left.
+static bool jgl_clip_span(Canvas c, int *x0, int *x1)
+{
+	if (*x0 < 0) *x0 = 0;
+	if (*x1 > (int) c.width) *x1 = (int) c.width;
+	return *x0 < *x1;
+}
+
+// Filled primitives come in an opaque and a blended variant generated from one
+// body; the public function picks one from the color's alpha once per call and
+// returns early on fully transparent colors.
+
+#define JGL_DISPATCH_ALPHA(color, name, ...) \
+	do { \
+		switch (JGL_ALPHA(color)) { \
+		case 0x00: return; \
+		case 0xFF: name##_opaque(__VA_ARGS__); return; \
+		default: name##_blend(__VA_ARGS__); return; \
+		} \
+	} while (0)
+
+#define JGL_DEFINE_FILL_RECT(variant) \
+static void jgl_fill_rect_##variant(Canvas c, int x0, int y0, size_t w, size_t h, uint32_t color) \
+{ \
+	void (*span)(uint32_t *, size_t, uint32_t) = jgl_kernels.variant; \
+	for (int dy = 0; dy < (int) h; ++dy) { \
+		int y = y0 + dy; \
+		int xa = x0, xb = x0 + (int) w; \
+		if (0 <= y && y < (int) c.height && jgl_clip_span(c, &xa, &xb)) { \
+			span(&PIXEL(c, xa, y), xb - xa, color); \
+		} \
+	} \
+}
+
+JGL_DEFINE_FILL_RECT(opaque)
+JGL_DEFINE_FILL_RECT(blend)
+
+void jgl_fill_rect(Canvas c, int x0, int y0, size_t w, size_t h, uint32_t color)
+{
+	JGL_DISPATCH_ALPHA(color, jgl_fill_rect, c, x0, y0, w, h, color);
+}
+
+// Largest k with k*k <= n.
+static int jgl_isqrt(int n)
+{
+	int k = (int) sqrt((double) n);
+	while (k > 0 && k*k > n) --k;
+	while ((k + 1)*(k + 1) <= n) ++k;
+	return k;
+}
+
+#define JGL_DEFINE_FILL_CIRCLE(variant) \
+static void jgl_fill_circle_##variant(Canvas c, int cx, int cy, size_t r, uint32_t color) \
+{ \
+	void (*span)(uint32_t *, size_t, uint32_t) = jgl_kernels.variant; \
+	int y1 = cy - (int) r; \
+	int y2 = cy + (int) r; \
+	for (int y = y1; y <= y2; ++y) { \
+		if (0 <= y && y < (int) c.height) { \
+			int dy = y - cy; \
+			int rr = (int) r * (int) r - dy*dy; \
+			if (rr < 0) continue; \
+			int half = jgl_isqrt(rr); \
+			int xa = cx - half, xb = cx + half + 1; \
+			if (jgl_clip_span(c, &xa, &xb)) { \
+				span(&PIXEL(c, xa, y), xb - xa, color); \
+			} \
+		} \
+	} \
+}
+
+JGL_DEFINE_FILL_CIRCLE(opaque)
+JGL_DEFINE_FILL_CIRCLE(blend)
+
+void jgl_fill_circle(Canvas c, int cx, int cy, size_t r, uint32_t color)
+{
+	JGL_DISPATCH_ALPHA(color, jgl_fill_circle, c, cx, cy, r, color);
 }
 
 void swap_int(int *x1, int *x2)
@@ -236,6 +723,8 @@ void barycentric(float x1, float y1, float x2, float y2, float x3, float y3,
 	*u3 = 1 - *u1 - *u2;
 }
 
+// Both loops are clamped to the canvas up front, so cost is bounded by the
+// visible part of the line however long it is.
 void jgl_draw_line(uint32_t *pixels, size_t px_width, size_t px_height, int x1, int y1, int x2, int y2, uint32_t color)
 {
 	int dx = x2 - x1;
@@ -245,16 +734,16 @@ void jgl_draw_line(uint32_t *pixels, size_t px_width, size_t px_height, int x1,
 		int c = y1 - dy*x1/dx;
 
 		if (x1 > x2) swap_int(&x1, &x2);
+		if (x1 < 0) x1 = 0;
+		if (x2 >= (int) px_width) x2 = (int) px_width - 1;
 		for (int x = x1; x <= x2; ++x) {
-			if (0 <= x && x < (int) px_width) {
-				int sy1 = dy*x/dx + c;
-				int sy2 = dy*(x + 1)/dx + c;
-				if (sy1 > sy2) swap_int(&sy1, &sy2);
-				for (int y = sy1; y <= sy2; ++y) {
-					if (0 <= y && y < (int) px_height) {
-						pixels[y*px_width + x] = color; 
-					}
-				}
+			int sy1 = dy*x/dx + c;
+			int sy2 = dy*(x + 1)/dx + c;
+			if (sy1 > sy2) swap_int(&sy1, &sy2);
+			if (sy1 < 0) sy1 = 0;
+			if (sy2 >= (int) px_height) sy2 = (int) px_height - 1;
+			for (int y = sy1; y <= sy2; ++y) {
+				pixels[y*px_width + x] = color; 
 			}
 		}
 	}
@@ -262,15 +751,134 @@ void jgl_draw_line(uint32_t *pixels, size_t px_width, size_t px_height, int x1,
 		int x = x1;
 		if (0 <= x && x < (int) px_width) {
 			if (y1 > y2) swap_int(&y1, &y2);
+			if (y1 < 0) y1 = 0;
+			if (y2 >= (int) px_height) y2 = (int) px_height - 1;
 			for (int y = y1; y <= y2; ++y) {
-				if (0 <= y && y < (int) px_height) {
-					pixels[y*px_width + x] = color;
-				}
+				pixels[y*px_width + x] = color;
 			}
 		}
 	}	
 }
 
+// Steps taken along the minor axis after k steps along the major one on a
+// Bresenham line spanning n pixels on its major axis and d <= n on its minor.
+int jgl_line_minor(int n, int d, int k)
+{
+	return n ? (int) ((2LL*d*k + n) / (2LL*n)) : 0;
+}
+
+// Smallest k >= 0 with jgl_line_minor(n, d, k) >= m, and the largest with it
+// <= m; d must be positive.
+static long long jgl_line_first(int n, int d, long long m)
+{
+	long long q = 2LL*n*m - n;
+	return q <= 0 ? 0 : (q + 2LL*d - 1) / (2LL*d);
+}
+
+static long long jgl_line_last(int n, int d, long long m)
+{
+	long long q = 2LL*n*m + n - 1;
+	return q < 0 ? -1 : q / (2LL*d);
+}
+
+// Steps k0..k1 of a Bresenham walk from (u, v) with step directions su, sv
+// (n major steps, d minor) that land inside a ulen x vlen canvas, in the walk's
+// own axes. False when there are none.
+static bool jgl_line_range(int n, int d, int u, int v, int su, int sv, long long ulen, long long vlen, long long *k0, long long *k1)
+{
+	long long t;
+	*k0 = 0;
+	*k1 = n;
+
+	// Steps whose major coordinate u + su*k lies in [0, ulen).
+	t = su > 0 ? -u : u - (ulen - 1);
+	if (t > *k0) *k0 = t;
+	t = su > 0 ? ulen - 1 - u : u;
+	if (t < *k1) *k1 = t;
+	if (*k0 > *k1) return false;
+
+	// Of those, the ones whose minor offset m keeps v + sv*m in [0, vlen).
+	long long mlo = sv > 0 ? -v : v - (vlen - 1);
+	long long mhi = sv > 0 ? vlen - 1 - v : v;
+	if (d == 0) return mlo <= 0 && mhi >= 0;
+	t = jgl_line_first(n, d, mlo);
+	if (t > *k0) *k0 = t;
+	t = jgl_line_last(n, d, mhi);
+	if (t < *k1) *k1 = t;
+	return *k0 <= *k1;
+}
+
+// Bresenham from (x1, y1) to (x2, y2), both ends included. Writes exactly the
+// pixels the full walk would, restricted to the canvas, but starts at the
+// first step inside it, so a line crossing a small canvas (such as a tile from
+// jgl_subcanvas()) costs only what it covers there.
+void jgl_plot_line(Canvas c, int x1, int y1, int x2, int y2, uint32_t color)
+{
+	int dx = abs(x2 - x1), dy = abs(y2 - y1);
+	bool xmajor = dx >= dy;
+	int n = xmajor ? dx : dy, d = xmajor ? dy : dx;
+	int u = xmajor ? x1 : y1, v = xmajor ? y1 : x1;
+	int su = (xmajor ? x1 < x2 : y1 < y2) ? 1 : -1;
+	int sv = (xmajor ? y1 < y2 : x1 < x2) ? 1 : -1;
+	long long k0, k1;
+	if (!jgl_line_range(n, d, u, v, su, sv, xmajor ? c.width : c.height, xmajor ? c.height : c.width, &k0, &k1)) return;
+
+	int k = (int) k0, m = jgl_line_minor(n, d, k);
+	long long e = 2LL*d*k + n - 2LL*n*m;
+	size_t ustep = xmajor ? 1 : c.stride, vstep = xmajor ? c.stride : 1;
+	uint32_t *p = &c.pixels[(u + su*k)*ustep + (v + sv*m)*vstep];
+	ptrdiff_t pu = su*(ptrdiff_t) ustep, pv = sv*(ptrdiff_t) vstep;
+	for (;;) {
+		*p = color;
+		if (k++ == (int) k1) break;
+		p += pu;
+		e += 2LL*d;
+		if (e >= 2LL*n) {
+			e -= 2LL*n;
+			p += pv;
+		}
+	}
+}
+
+// jgl_plot_line() tested against d, which covers the same pixels as c. Depth
+// runs linearly from z1 to z2 along the major axis and is computed afresh at
+// each step, so a line split across tiles tests the same values. A pixel is
+// written when z*(1 + bias) is at least the stored depth, letting edges win
+// over the faces they lie on; depth itself is left alone.
+void jgl_plot_line_z(Canvas c, Depth_Canvas d, int x1, int y1, int x2, int y2, float z1, float z2, float bias, uint32_t color)
+{
+	int dx = abs(x2 - x1), dy = abs(y2 - y1);
+	bool xmajor = dx >= dy;
+	int n = xmajor ? dx : dy, dm = xmajor ? dy : dx;
+	int u = xmajor ? x1 : y1, v = xmajor ? y1 : x1;
+	int su = (xmajor ? x1 < x2 : y1 < y2) ? 1 : -1;
+	int sv = (xmajor ? y1 < y2 : x1 < x2) ? 1 : -1;
+	long long k0, k1;
+	if (!jgl_line_range(n, dm, u, v, su, sv, xmajor ? c.width : c.height, xmajor ? c.height : c.width, &k0, &k1)) return;
+
+	int k = (int) k0, m = jgl_line_minor(n, dm, k);
+	long long e = 2LL*dm*k + n - 2LL*n*m;
+	size_t ustep = xmajor ? 1 : c.stride, vstep = xmajor ? c.stride : 1;
+	size_t zustep = xmajor ? 1 : d.stride, zvstep = xmajor ? d.stride : 1;
+	uint32_t *p = &c.pixels[(u + su*k)*ustep + (v + sv*m)*vstep];
+	float *q = &d.depth[(u + su*k)*zustep + (v + sv*m)*zvstep];
+	ptrdiff_t pu = su*(ptrdiff_t) ustep, pv = sv*(ptrdiff_t) vstep;
+	ptrdiff_t qu = su*(ptrdiff_t) zustep, qv = sv*(ptrdiff_t) zvstep;
+	double dz = n ? ((double) z2 - z1)/n : 0, scale = 1.0 + bias;
+	for (;;) {
+		if ((float) ((z1 + k*dz)*scale) >= *q) *p = color;
+		if (k++ == (int) k1) break;
+		p += pu;
+		q += qu;
+		e += 2LL*dm;
+		if (e >= 2LL*n) {
+			e -= 2LL*n;
+			p += pv;
+			q += qv;
+		}
+	}
+}
+
 bool jgl_normalize_triangle(size_t width, size_t height, int x1, int y1, int x2, int y2, int x3, int y3, int *lx, int *hx, int *ly, int *hy)
 {
     *lx = x1;
@@ -299,178 +907,323 @@ bool jgl_normalize_triangle(size_t width, size_t height, int x1, int y1, int x2,
 }
 // TODO: rewrite triangle generating functions using normalize_triangle
 
-void jgl_triangle3c(Canvas c,
+// Shaded triangles use a half-space rasterizer. Vertices are fixed point with
+// JGL_SUBPIXEL_BITS fractional bits and pixels are sampled at their centers.
+// Each row's covered span is solved exactly from the three edge functions,
+// with the top-left rule giving pixels on a shared edge to just one of the
+// triangles, so meshes have neither cracks nor doubly blended seams.
+// Attributes are planes set up once per triangle and stepped per pixel, colors
+// by the `shade` span kernel.
+
+#define JGL_SUBPIXEL_BITS 4
+#define JGL_SUBPIXEL (1 << JGL_SUBPIXEL_BITS)
+
+typedef struct {
+	int64_t a[3], b[3], c[3];	// E_i(X, Y) = a*X + b*Y + c, positive inside
+	int64_t bias[3];			// -1 on edges that are neither top nor left
+	int64_t area;				// E_i at vertex i: twice the triangle's area
+	int x0, y0, x1, y1;			// covered pixels, clipped to the canvas
+	int xref;					// x0 before clipping
+} Jgl_Triangle;
+
+// floor(n / d) for d > 0.
+static int64_t jgl_floordiv(int64_t n, int64_t d)
+{
+	return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+// Edge i runs between the two vertices other than i. False when the triangle
+// is degenerate or misses the canvas.
+static bool jgl_triangle_setup(size_t width, size_t height, Jgl_Triangle *t, const int x[3], const int y[3])
+{
+	for (int i = 0; i < 3; ++i) {
+		int p = (i + 1) % 3, q = (i + 2) % 3;
+		t->a[i] = (int64_t) y[q] - y[p];
+		t->b[i] = (int64_t) x[p] - x[q];
+		t->c[i] = -t->a[i]*x[p] - t->b[i]*y[p];
+	}
+	t->area = t->a[0]*x[0] + t->b[0]*y[0] + t->c[0];
+	if (t->area == 0) return false;
+	if (t->area < 0) {
+		t->area = -t->area;
+		for (int i = 0; i < 3; ++i) {
+			t->a[i] = -t->a[i];
+			t->b[i] = -t->b[i];
+			t->c[i] = -t->c[i];
+		}
+	}
+	// y grows downwards: a left edge has the inside to its right (a > 0), a top
+	// edge is horizontal with the inside below it (b > 0).
+	for (int i = 0; i < 3; ++i) {
+		t->bias[i] = t->a[i] > 0 || (t->a[i] == 0 && t->b[i] > 0) ? 0 : -1;
+	}
+
+	int lx = x[0], hx = x[0], ly = y[0], hy = y[0];
+	for (int i = 1; i < 3; ++i) {
+		if (x[i] < lx) lx = x[i];
+		if (x[i] > hx) hx = x[i];
+		if (y[i] < ly) ly = y[i];
+		if (y[i] > hy) hy = y[i];
+	}
+	t->x0 = (int) -jgl_floordiv(JGL_SUBPIXEL/2 - (int64_t) lx, JGL_SUBPIXEL);
+	t->x1 = (int) jgl_floordiv((int64_t) hx - JGL_SUBPIXEL/2, JGL_SUBPIXEL);
+	t->y0 = (int) -jgl_floordiv(JGL_SUBPIXEL/2 - (int64_t) ly, JGL_SUBPIXEL);
+	t->y1 = (int) jgl_floordiv((int64_t) hy - JGL_SUBPIXEL/2, JGL_SUBPIXEL);
+	t->xref = t->x0;
+	if (t->x0 < 0) t->x0 = 0;
+	if (t->y0 < 0) t->y0 = 0;
+	if (t->x1 >= (int) width) t->x1 = (int) width - 1;
+	if (t->y1 >= (int) height) t->y1 = (int) height - 1;
+	return t->x0 <= t->x1 && t->y0 <= t->y1;
+}
+
+// Covered pixels [*xa, *xb] of row y, from where each edge function crosses
+// zero along the row; false when there are none.
+static bool jgl_triangle_span(const Jgl_Triangle *t, int y, int *xa, int *xb)
+{
+	int64_t X = (int64_t) t->x0*JGL_SUBPIXEL + JGL_SUBPIXEL/2;
+	int64_t Y = (int64_t) y*JGL_SUBPIXEL + JGL_SUBPIXEL/2;
+	int64_t lo = t->x0, hi = t->x1;
+	for (int i = 0; i < 3; ++i) {
+		int64_t e = t->a[i]*X + t->b[i]*Y + t->c[i] + t->bias[i];
+		int64_t step = t->a[i]*JGL_SUBPIXEL;
+		if (step > 0) {
+			int64_t k = t->x0 - jgl_floordiv(e, step);
+			if (k > lo) lo = k;
+		} else if (step < 0) {
+			int64_t k = t->x0 + jgl_floordiv(e, -step);
+			if (k < hi) hi = k;
+		} else if (e < 0) {
+			return false;
+		}
+	}
+	*xa = (int) lo;
+	*xb = (int) hi;
+	return lo <= hi;
+}
+
+// Attribute f[i] at vertex i interpolated to the center of pixel (x, y) from
+// the exact edge functions there, and its step along a row. Rows are stepped
+// from t->xref, the triangle's own left edge, so a pixel's value depends only
+// on where it is relative to the vertices: drawing through sub-canvases gives
+// the same values as drawing the whole canvas.
+static double jgl_triangle_value(const Jgl_Triangle *t, const float f[3], int x, int y)
+{
+	int64_t X = (int64_t) x*JGL_SUBPIXEL + JGL_SUBPIXEL/2;
+	int64_t Y = (int64_t) y*JGL_SUBPIXEL + JGL_SUBPIXEL/2;
+	double v = 0;
+	for (int i = 0; i < 3; ++i) {
+		v += f[i]*(double) (t->a[i]*X + t->b[i]*Y + t->c[i]);
+	}
+	return v/(double) t->area;
+}
+
+static double jgl_triangle_step(const Jgl_Triangle *t, const float f[3])
+{
+	double v = 0;
+	for (int i = 0; i < 3; ++i) {
+		v += f[i]*(double) (t->a[i]*JGL_SUBPIXEL);
+	}
+	return v/(double) t->area;
+}
+
+// Vertices in 1/JGL_SUBPIXEL pixel units from the canvas's top-left corner;
+// pixel (x, y) is sampled at (x + 1/2, y + 1/2).
+void jgl_triangle3c_fixed(Canvas c,
 		       int x1, int y1,
 		       int x2, int y2,
 		       int x3, int y3,
 		       uint32_t c1, uint32_t c2, uint32_t c3)
-{	
-	if (y1 > y2) {
-		swap_int(&x1, &x2);
-		swap_int(&y1, &y2);
-		swap_int(&c1, &c2);
-	} 
-	if (y2 > y3) {
-		swap_int(&x2, &x3);
-		swap_int(&y2, &y3);
-		swap_int(&c2, &c3);
-	} 
-	if (y1 > y2) {
-		swap_int(&x1, &x2);
-		swap_int(&y1, &y2);
-		swap_int(&c1, &c2);
-	} 
-
-	int dx12 = x2 - x1;
-	int dy12 = y2 - y1;
-	int dx13 = x3 - x1;
-	int dy13 = y3 - y1;
-			
-	for (int y = y1; y < y2; ++y) {
-		if (0 <= y && (size_t) y < c.height) {
-			int s1 = dy12 != 0 ? (y - y1)*dx12/dy12 + x1 : x1;
-			int s2 = dy13 != 0 ? (y - y1)*dx13/dy13 + x1 : x1;
-			if (s1 > s2) swap_int(&s1, &s2);
-			for (int x = s1; x <= s2; ++x) {
-				if (0 <= x && (size_t) x < c.width) {
-					float u1, u2, u3;
-					barycentric(x1, y1, x2, y2, x3, y3, x, y, &u1, &u2, &u3);
-					uint32_t color = mix_colors3(c1, c2, c3, u1, u2, u3);
-					blend_colors(&PIXEL(c, x, y), color);
-				}
-			}
-		}
+{
+	const int x[3] = {x1, x2, x3}, y[3] = {y1, y2, y3};
+	Jgl_Triangle t;
+	if (!jgl_triangle_setup(c.width, c.height, &t, x, y)) return;
+
+	float f[COUNT_COMPS][3];
+	int32_t v[COUNT_COMPS], dv[COUNT_COMPS];
+	for (int comp = 0; comp < COUNT_COMPS; ++comp) {
+		f[comp][0] = (c1 >> 8*comp) & 0xFF;
+		f[comp][1] = (c2 >> 8*comp) & 0xFF;
+		f[comp][2] = (c3 >> 8*comp) & 0xFF;
+		dv[comp] = (int32_t) (jgl_triangle_step(&t, f[comp])*65536.0);
 	}
+	bool opaque = (c1 & c2 & c3) >> 24 == 0xFF;
+	if (!opaque && (c1 | c2 | c3) >> 24 == 0) return;
 
-	int dx32 = x2 - x3;
-    int dy32 = y2 - y3;
-    int dx31 = x1 - x3;
-    int dy31 = y1 - y3;
-
-	for (int y = y2; y <= y3; ++y) {
-		if (0 <= y && (size_t) y < c.height) {
-			int s1 = dy32 != 0 ? (y - y3)*dx32/dy32 + x3 : x3;
-			int s2 = dy31 != 0 ? (y - y3)*dx31/dy31 + x3 : x3;
-			if (s1 > s2) swap_int(&s1, &s2);
-			for (int x = s1; x <= s2; ++x) {
-				if (0 <= x && (size_t) x < c.width) {
-					float u1, u2, u3;
-					barycentric(x1, y1, x2, y2, x3, y3, x, y, &u1, &u2, &u3);
-					uint32_t color = mix_colors3(c1, c2, c3, u1, u2, u3);
-					blend_colors(&PIXEL(c, x, y), color);
-				}
-			}
+	for (int y = t.y0; y <= t.y1; ++y) {
+		int xa, xb;
+		if (!jgl_triangle_span(&t, y, &xa, &xb)) continue;
+		for (int comp = 0; comp < COUNT_COMPS; ++comp) {
+			int64_t row = (int64_t) ((jgl_triangle_value(&t, f[comp], t.xref, y) + 0.5)*65536.0);
+			v[comp] = (int32_t) (row + (int64_t) (xa - t.xref)*dv[comp]);
 		}
+		jgl_kernels.shade(&PIXEL(c, xa, y), xb - xa + 1, v, dv, opaque);
 	}
 }
 
-void jgl_triangle3z(Canvas c, int x1, int y1, int x2, int y2, int x3, int y3, float z1, float z2, float z3)
-{
-	if (y1 > y2) {
-		swap_int(&x1, &x2);
-		swap_int(&y1, &y2);
-		swap_float(&z1, &z2);
-	} 
-	if (y2 > y3) {
-		swap_int(&x2, &x3);
-		swap_int(&y2, &y3);
-		swap_float(&z2, &z3);
-	} 
-	if (y1 > y2) {
-		swap_int(&x1, &x2);
-		swap_int(&y1, &y2);
-		swap_float(&z1, &z2);
-	} 
-
-	int dx12 = x2 - x1;
-	int dy12 = y2 - y1;
-	int dx13 = x3 - x1;
-	int dy13 = y3 - y1;
-			
-	for (int y = y1; y < y2; ++y) {
-		if (0 <= y && (size_t) y < c.height) {
-			int s1 = dy12 != 0 ? (y - y1)*dx12/dy12 + x1 : x1;
-			int s2 = dy13 != 0 ? (y - y1)*dx13/dy13 + x1 : x1;
-			if (s1 > s2) swap_int(&s1, &s2);
-			for (int x = s1; x <= s2; ++x) {
-				if (0 <= x && (size_t) x < c.width) {
-					float u1, u2, u3;
-					barycentric(x1, y1, x2, y2, x3, y3, x, y, &u1, &u2, &u3);
-					float z = z1*u1 + z2*u2 +z3*u3;
-					PIXEL(c, x, y) = *(uint32_t*)&z;
-				}
-			}
+// Integer vertices are pixel centers.
+void jgl_triangle3c(Canvas c,
+		       int x1, int y1,
+		       int x2, int y2,
+		       int x3, int y3,
+		       uint32_t c1, uint32_t c2, uint32_t c3)
+{
+	const int s = JGL_SUBPIXEL, h = JGL_SUBPIXEL/2;
+	jgl_triangle3c_fixed(c, x1*s + h, y1*s + h, x2*s + h, y2*s + h, x3*s + h, y3*s + h, c1, c2, c3);
+}
+
+// Depth-tested span of n pixels from (x, y); pixel i is at depth
+// (float) (z0 + (k + i)*dz), computed afresh rather than stepped so it is the
+// same for any k and i that add up to the same pixel. Pixels nearer
+// than the buffer take their depth and, unless dst is NULL, the color: stored
+// keeping destination alpha when opaque, blended otherwise. Afterwards the
+// segments lying wholly inside the canvas get their hi-z recomputed; partial
+// ones keep theirs, which stays valid since depths only ever get nearer.
+static void jgl_depth_span(Depth_Canvas d, uint32_t *dst, int x, int y, int n, double z0, double dz, int k, uint32_t color)
+{
+	float *depth = &DEPTH(d, x, y);
+	float *hiz = d.hiz ? d.hiz + y*d.hiz_stride : NULL;
+	size_t s0 = (d.hiz_phase + x)/JGL_HIZ, s1 = (d.hiz_phase + x + n - 1)/JGL_HIZ, s;
+	bool opaque = JGL_ALPHA(color) == 0xFF;
+
+	if (hiz) {
+		float zmax = fmaxf((float) (z0 + k*dz), (float) (z0 + (k + n - 1)*dz));
+		for (s = s0; s <= s1 && zmax <= hiz[s]; ++s);
+		if (s > s1) return;
+	}
+	for (int i = 0; i < n; ++i) {
+		float z = (float) (z0 + (k + i)*dz);
+		if (z > depth[i]) {
+			depth[i] = z;
+			if (dst == NULL) continue;
+			if (opaque) dst[i] = (dst[i] & 0xFF000000) | (color & 0x00FFFFFF);
+			else blend_colors(&dst[i], color);
 		}
 	}
-
-	int dx32 = x2 - x3;
-    int dy32 = y2 - y3;
-    int dx31 = x1 - x3;
-    int dy31 = y1 - y3;
-
-	for (int y = y2; y <= y3; ++y) {
-		if (0 <= y && (size_t) y < c.height) {
-			int s1 = dy32 != 0 ? (y - y3)*dx32/dy32 + x3 : x3;
-			int s2 = dy31 != 0 ? (y - y3)*dx31/dy31 + x3 : x3;
-			if (s1 > s2) swap_int(&s1, &s2);
-			for (int x = s1; x <= s2; ++x) {
-				if (0 <= x && (size_t) x < c.width) {
-					float u1, u2, u3;
-					barycentric(x1, y1, x2, y2, x3, y3, x, y, &u1, &u2, &u3);
-					float z = z1*u1 + z2*u2 +z3*u3;
-					PIXEL(c, x, y) = *(uint32_t*)&z;
-				}
-			}
+	if (hiz) {
+		for (s = s0; s <= s1; ++s) {
+			int a = (int) (s*JGL_HIZ) - (int) d.hiz_phase;
+			if (a < 0 || a + JGL_HIZ > (int) d.width) continue;
+			float *seg = &DEPTH(d, a, y), m = seg[0];
+			for (int i = 1; i < JGL_HIZ; ++i) m = fminf(m, seg[i]);
+			hiz[s] = m;
 		}
 	}
 }
 
-void jgl_fill_triangle(Canvas c,
+static void jgl_depth_triangle(Depth_Canvas d, uint32_t *dst, size_t stride, const int x[3], const int y[3], const float z[3], uint32_t color)
+{
+	Jgl_Triangle t;
+	if (!jgl_triangle_setup(d.width, d.height, &t, x, y)) return;
+
+	double dz = jgl_triangle_step(&t, z);
+	for (int y = t.y0; y <= t.y1; ++y) {
+		int xa, xb;
+		if (!jgl_triangle_span(&t, y, &xa, &xb)) continue;
+		double row = jgl_triangle_value(&t, z, t.xref, y);
+		jgl_depth_span(d, dst ? dst + y*stride + xa : NULL, xa, y, xb - xa + 1, row, dz, xa - t.xref, color);
+	}
+}
+
+// Depth only, for laying down occluders.
+void jgl_triangle3z_fixed(Depth_Canvas d, int x1, int y1, int x2, int y2, int x3, int y3, float z1, float z2, float z3)
+{
+	const int x[3] = {x1, x2, x3}, y[3] = {y1, y2, y3};
+	const float z[3] = {z1, z2, z3};
+	jgl_depth_triangle(d, NULL, 0, x, y, z, 0);
+}
+
+void jgl_triangle3z(Depth_Canvas d, int x1, int y1, int x2, int y2, int x3, int y3, float z1, float z2, float z3)
+{
+	const int s = JGL_SUBPIXEL, h = JGL_SUBPIXEL/2;
+	jgl_triangle3z_fixed(d, x1*s + h, y1*s + h, x2*s + h, y2*s + h, x3*s + h, y3*s + h, z1, z2, z3);
+}
+
+// A flat triangle drawn into c where it is nearer than d; c and d cover the
+// same pixels.
+void jgl_fill_triangle3z_fixed(Canvas c, Depth_Canvas d,
 		       int x1, int y1,
 		       int x2, int y2,
 		       int x3, int y3,
+		       float z1, float z2, float z3,
 		       uint32_t color)
-{	
-	sort_triangle_pts_by_y(&x1, &y1, &x2, &y2, &x3, &y3);
-	
-	int dx12 = x2 - x1;
-	int dy12 = y2 - y1;
-	int dx13 = x3 - x1;
-	int dy13 = y3 - y1;
-	int dx23 = x3 - x2;
-	int dy23 = y3 - y2;
-			
-	for (int y = y1; y < y2; ++y) {
-		if (0 <= y && (size_t) y < c.height) {
-			int s1 = dy12 != 0 ? (y - y1)*dx12/dy12 + x1 : x1;
-			int s2 = dy13 != 0 ? (y - y1)*dx13/dy13 + x1 : x1;
-			if (s1 > s2) swap_int(&s1, &s2);
-			for (int x = s1; x <= s2; ++x) {
-				if (0 <= x && (size_t) x < c.width) {
-					blend_colors(&PIXEL(c, x, y), color);
-				}
-			}
-		}
-	}
-	for (int y = y2; y <= y3; ++y) {
-		if (0 <= y && (size_t) y < c.height) {
-			int s1 = dy23 != 0 ? (y - y3)*dx23/dy23 + x3 : x3;
-			int s2 = dy13 != 0 ? (y - y3)*dx13/dy13 + x3 : x3;
-			if (s1 > s2) swap_int(&s1, &s2);
-			for (int x = s1; x <= s2; ++x) {
-				if (0 <= x && (size_t) x < c.width) {
-					blend_colors(&PIXEL(c, x, y), color);
-				}
-			}
+{
+	const int x[3] = {x1, x2, x3}, y[3] = {y1, y2, y3};
+	const float z[3] = {z1, z2, z3};
+	if (JGL_ALPHA(color) == 0) return;
+	jgl_depth_triangle(d, c.pixels, c.stride, x, y, z, color);
+}
+
+// A disc at constant depth z, depth only.
+void jgl_circlez(Depth_Canvas d, int cx, int cy, size_t r, float z)
+{
+	for (int y = cy - (int) r; y <= cy + (int) r; ++y) {
+		if (0 <= y && y < (int) d.height) {
+			int dy = y - cy;
+			int half = jgl_isqrt((int) r * (int) r - dy*dy);
+			int xa = cx - half, xb = cx + half + 1;
+			if (xa < 0) xa = 0;
+			if (xb > (int) d.width) xb = (int) d.width;
+			if (xa < xb) jgl_depth_span(d, NULL, xa, y, xb - xa, z, 0, 0, 0);
 		}
 	}
 }
 
-/*
+#define JGL_DEFINE_FILL_TRIANGLE(variant) \
+static void jgl_fill_triangle_##variant(Canvas c, int x1, int y1, int x2, int y2, int x3, int y3, uint32_t color) \
+{ \
+	void (*span)(uint32_t *, size_t, uint32_t) = jgl_kernels.variant; \
+	sort_triangle_pts_by_y(&x1, &y1, &x2, &y2, &x3, &y3); \
+	\
+	int dx12 = x2 - x1; \
+	int dy12 = y2 - y1; \
+	int dx13 = x3 - x1; \
+	int dy13 = y3 - y1; \
+	int dx23 = x3 - x2; \
+	int dy23 = y3 - y2; \
+	\
+	for (int y = y1; y < y2; ++y) { \
+		if (0 <= y && (size_t) y < c.height) { \
+			int s1 = dy12 != 0 ? (y - y1)*dx12/dy12 + x1 : x1; \
+			int s2 = dy13 != 0 ? (y - y1)*dx13/dy13 + x1 : x1; \
+			if (s1 > s2) swap_int(&s1, &s2); \
+			s2 += 1; \
+			if (jgl_clip_span(c, &s1, &s2)) { \
+				span(&PIXEL(c, s1, y), s2 - s1, color); \
+			} \
+		} \
+	} \
+	for (int y = y2; y <= y3; ++y) { \
+		if (0 <= y && (size_t) y < c.height) { \
+			int s1 = dy23 != 0 ? (y - y3)*dx23/dy23 + x3 : x3; \
+			int s2 = dy13 != 0 ? (y - y3)*dx13/dy13 + x3 : x3; \
+			if (s1 > s2) swap_int(&s1, &s2); \
+			s2 += 1; \
+			if (jgl_clip_span(c, &s1, &s2)) { \
+				span(&PIXEL(c, s1, y), s2 - s1, color); \
+			} \
+		} \
+	} \
+}
+
+JGL_DEFINE_FILL_TRIANGLE(opaque)
+JGL_DEFINE_FILL_TRIANGLE(blend)
+
+void jgl_fill_triangle(Canvas c,
+		       int x1, int y1,
+		       int x2, int y2,
+		       int x3, int y3,
+		       uint32_t color)
+{
+	JGL_DISPATCH_ALPHA(color, jgl_fill_triangle, c, x1, y1, x2, y2, x3, y3, color);
+}
+
 typedef int Errno;
 
 #define return_defer(value) do { result = (value); goto defer; }while (0)
 
+// Writes the canvas-sized pixels, width*height of them with no padding, as a
+// binary PPM; alpha is dropped. Returns 0 or the errno of the failed call.
 Errno jgl_save_to_ppm(uint32_t *pixels, size_t width, size_t height, const char *file_path)
 {
 	int result = 0;
@@ -500,6 +1253,7 @@ defer:
 	if (f)  fclose(f);
 	return result;
 }
-*/
+
+#undef return_defer
 
 #endif // JGL_C_
@@ -0,0 +1,119 @@
+#ifndef QOI_C_
+#define QOI_C_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// QOI ("Quite OK Image") encoder, https://qoiformat.org. Lossless and cheap:
+// one pass, a 64-entry table of recently seen colors, no entropy coding. A
+// frame of mostly flat background with thin lines packs into runs and small
+// diffs, so it is a fraction of its raw size at memcpy-like speed. Pixels are
+// 0xAABBGGRR, which is RGBA byte order on a little-endian machine, and are
+// written with all four channels.
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_BUFFER   (1 << 16)
+
+typedef struct {
+	FILE *f;
+	size_t len;
+	unsigned char data[QOI_BUFFER];
+} Qoi_Out;
+
+static void qoi_flush(Qoi_Out *o)
+{
+	fwrite(o->data, 1, o->len, o->f);
+	o->len = 0;
+}
+
+static void qoi_u32(Qoi_Out *o, uint32_t v)
+{
+	o->data[o->len++] = v >> 24;
+	o->data[o->len++] = v >> 16;
+	o->data[o->len++] = v >> 8;
+	o->data[o->len++] = v;
+}
+
+// Appends one image of width*height pixels, rows `stride` apart, to f.
+// Returns 0, or nonzero once f has an error.
+int qoi_write(FILE *f, const uint32_t *pixels, int width, int height, size_t stride)
+{
+	Qoi_Out o;
+	uint32_t index[64], prev = 0xff000000;
+	int run = 0;
+
+	memset(index, 0, sizeof(index));
+	o.f = f;
+	memcpy(o.data, "qoif", 4);
+	o.len = 4;
+	qoi_u32(&o, width);
+	qoi_u32(&o, height);
+	o.data[o.len++] = 4;	// RGBA
+	o.data[o.len++] = 0;	// sRGB with linear alpha
+
+	for (int y = 0; y < height; ++y) {
+		const uint32_t *row = pixels + y*stride;
+		for (int x = 0; x < width; ++x) {
+			uint32_t px = row[x];
+			if (o.len > QOI_BUFFER - 8) qoi_flush(&o);
+			if (px == prev) {
+				if (++run == 62) {
+					o.data[o.len++] = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				o.data[o.len++] = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			int r = px & 0xff, g = px >> 8 & 0xff, b = px >> 16 & 0xff, a = px >> 24;
+			int hash = (r*3 + g*5 + b*7 + a*11) % 64;
+			if (index[hash] == px) {
+				o.data[o.len++] = QOI_OP_INDEX | hash;
+			} else {
+				index[hash] = px;
+				if (a == (int) (prev >> 24)) {
+					signed char vr = r - (int) (prev & 0xff);
+					signed char vg = g - (int) (prev >> 8 & 0xff);
+					signed char vb = b - (int) (prev >> 16 & 0xff);
+					signed char vg_r = vr - vg, vg_b = vb - vg;
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						o.data[o.len++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+					} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+						o.data[o.len++] = QOI_OP_LUMA | (vg + 32);
+						o.data[o.len++] = (vg_r + 8) << 4 | (vg_b + 8);
+					} else {
+						o.data[o.len++] = QOI_OP_RGB;
+						o.data[o.len++] = r;
+						o.data[o.len++] = g;
+						o.data[o.len++] = b;
+					}
+				} else {
+					o.data[o.len++] = QOI_OP_RGBA;
+					o.data[o.len++] = r;
+					o.data[o.len++] = g;
+					o.data[o.len++] = b;
+					o.data[o.len++] = a;
+				}
+			}
+			prev = px;
+		}
+	}
+	qoi_flush(&o);
+	if (run > 0) o.data[o.len++] = QOI_OP_RUN | (run - 1);
+	memcpy(o.data + o.len, "\0\0\0\0\0\0\0\1", 8);
+	o.len += 8;
+	qoi_flush(&o);
+	return ferror(f);
+}
+
+#endif // QOI_C_
@@ -1,23 +1,51 @@
+#ifndef HEADLESS
 #include <SDL.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #include "jgl.c"
+#include "arena.c"
+#include "qoi.c"
 
-#define WIDTH 3072
-#define HEIGHT 1920
 #define PI 3.14159265358979323846
 #define BGCOLOR 0x00202020
+#define NEAR 0.1f
 
 #define return_defer(value) do {result = (value); goto defer;} while (0)
 
 /* Interface */
 
-static uint32_t pixels[WIDTH*HEIGHT], *dst=&pixels[0];
-static float zbuffer[WIDTH*HEIGHT] = {0};
-
+/* The framebuffer is screen_w x screen_h, taken from the window or --size;
+   pixels, zbuffer and hiz are allocated for it by allocscreen(). Frames are
+   width x height, the framebuffer size or less under dynamic resolution,
+   and live in the top-left corner of the buffers, which keep screen_w as
+   their stride. focal is the projection's scale in pixels, 500 at 3072
+   wide, so a scaled-down frame shows the same view. */
+static int screen_w = 3072, screen_h = 1920;
+static int width, height;
+static float focal;
+static uint32_t *pixels;
+static float *zbuffer, *hiz;
+
+#ifndef HEADLESS
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
-static SDL_Rect window_rect = {0, 0, WIDTH, HEIGHT};
+static SDL_Rect window_rect;
+#endif
 
 /* Abstraction */
 
@@ -29,23 +57,75 @@ typedef struct {
     float x, y, z;
 } Vector3;
 
+/* Endpoints as indices into the owning mesh's vertices; the color lives in
+   the mesh's parallel colors stream. */
 typedef struct {
-    uint32_t color;
-    Vector3 *a, *b;
+    uint32_t a, b;
 } Edge;
 
+/* A filled triangle over three of the mesh's vertices; its color lives in the
+   mesh's parallel face_colors stream. Quads are stored as two triangles.
+   Seen from outside, the corners of a closed mesh's faces run
+   counter-clockwise about the outward normal (b - a) x (c - a). */
+typedef struct {
+    uint32_t a, b, c;
+} Face;
+
+/* Open-addressed index over a mesh's vertices used by addvertex() to weld
+   duplicates. Slots hold vertex index + 1 (0 is empty) hashed by position,
+   or by epsilon-sized grid cell when epsilon > 0. Vertices [0, len) are
+   indexed; the rest are caught up lazily on the next insert. */
 typedef struct {
-    int vert_len, edge_len;
+    int *slots;
+    int cap, len;
+    float epsilon;
+} Weld;
+
+/* Screen pixels [x0, x1) x [y0, y1); empty when x0 >= x1 or y0 >= y1. */
+typedef struct {
+    int x0, y0, x1, y1;
+} Box;
+
+/* vertices, edges, colors, faces and face_colors are arena blocks holding
+   vert_cap/edge_cap/face_cap entries; they move when they grow, so refer to
+   vertices by index.
+   bmin/bmax bound the vertices (before position is added) and center/radius
+   is the sphere around that box.
+   edge_faces holds, for each edge, the two faces sharing it (NOFACE when it
+   borders fewer or more). closed is set when every side of every face is
+   shared with exactly one other face and the windings agree. Both are
+   rebuilt by meshtopology() when topo_edges/topo_faces fall behind.
+   dirty is set by anything that changes what the mesh looks like; shown is
+   the screen box it covered when last drawn and box the one it covers in
+   the frame being drawn. */
+typedef struct {
+    int vert_len, edge_len, face_len, vert_cap, edge_cap, face_cap;
     Vector3 position, *vertices;
+    Vector3 bmin, bmax, center;
+    float radius;
     Edge *edges;
+    uint32_t *colors;
+    Face *faces;
+    uint32_t *face_colors;
+    uint32_t *edge_faces;
+    int topo_edges, topo_faces, closed;
+    int dirty;
+    Box shown, box;
+    Weld weld;
 } Mesh;
 
 typedef struct {
-    int len;
+    int len, cap;
     Vector3 position, scale, rotation;
-    Mesh meshes[128];
+    float weld;  /* epsilon new meshes weld vertices within, see setweld() */
+    Mesh **meshes;
 } Scene;
 
+/* Affine transform: row r maps (x, y, z) to m[r][0]*x + m[r][1]*y + m[r][2]*z + m[r][3]. */
+typedef struct {
+    float m[3][4];
+} Matrix;
+
 typedef struct {
     Vector3 *items;
     size_t capacity;
@@ -63,8 +143,7 @@ typedef struct {
 } Mouse;
 
 
-static Vector3 vertices[0x10000], *_vertices = &vertices[0];
-static Edge edges[0x8000], *_edges = &edges[0];
+static Arena arena;
 static Scene scene;
 static Camera cam;
 static Mouse mouse;
@@ -113,38 +192,35 @@ Vector3 remap(Vector3 v, float lx, float hx, float ly, float hy, float lz, float
     return v;
 }
 
+/* Only meaningful when v3.z + c->range >= NEAR; see clipnear(). */
 static Vector2 cam_project(Camera *c, Vector3 v3)
 {
-    float r = 500 / (v3.z + c->range);
-    return vector2(WIDTH/2 + r*v3.x, HEIGHT/2 + r*v3.y);
+    float r = focal / (v3.z + c->range);
+    return vector2(width/2 + r*v3.x, height/2 + r*v3.y);
 }
 
 /* Geometry */
 
+#ifndef TRINKET_NO_MAIN
 static float lerp(float a, float b, float speed, float range)
 {
     if (a < b-range || a > b+range) a += (b-a) / speed;
     else a = b;
     return a;
 }
-
-static Vector2 rot2d(Vector2 a, Vector2 b, float deg)
-{
-    float rad = deg * (PI/180);
-    float angle = atan2f(b.y-a.y, b.x-a.x) + rad;
-    float mag = sqrtf((a.x-b.x)*(a.x-b.x) + (a.y-b.y)*(a.y-b.y));
-    return vector2(a.x + mag*cosf(angle), a.y + mag*sinf(angle));
-}
+#endif
 
 static int equ3d(Vector3 v1, Vector3 v2)
 {
     return v1.x == v2.x && v1.y == v2.y && v1.z == v2.z;
 }
 
+#ifndef TRINKET_NO_MAIN
 static Vector3 *addv3d(Vector3 *v, float x, float y, float z)
 {
     return set3d(v, v->x+x, v->y+y, v->z+z);
 }
+#endif
 
 static Vector3 add3d(Vector3 *a, Vector3 *b)
 {
@@ -168,109 +244,1828 @@ static Vector3 *scale3d(Vector3 *v, Vector3 *t)
     return v;
 }
 
+static Vector3 apply3d(Matrix *m, Vector3 v)
+{
+    return vector3(m->m[0][0]*v.x + m->m[0][1]*v.y + m->m[0][2]*v.z + m->m[0][3],
+                   m->m[1][0]*v.x + m->m[1][1]*v.y + m->m[1][2]*v.z + m->m[1][3],
+                   m->m[2][0]*v.x + m->m[2][1]*v.y + m->m[2][2]*v.z + m->m[2][3]);
+}
+
+/* a*b, i.e. b is applied first */
+static Matrix mult_mat(Matrix *a, Matrix *b)
+{
+    int r, c;
+    Matrix m;
+    for (r=0; r<3; r++) {
+        for (c=0; c<4; c++)
+            m.m[r][c] = a->m[r][0]*b->m[0][c] + a->m[r][1]*b->m[1][c] + a->m[r][2]*b->m[2][c];
+        m.m[r][3] += a->m[r][3];
+    }
+    return m;
+}
+
+/* Rotation by t (degrees) about o: pitch turns y toward z, then yaw turns x
+   toward z, then roll turns x toward y, all counterclockwise. */
+static Matrix rotation3d(Vector3 *o, Vector3 *t)
+{
+    float rx = t->x * (PI/180), ry = t->y * (PI/180), rz = t->z * (PI/180);
+    float cx = cosf(rx), sx = sinf(rx), cy = cosf(ry), sy = sinf(ry), cz = cosf(rz), sz = sinf(rz);
+    Matrix m = {{
+        {cz*cy, -cz*sy*sx - sz*cx, -cz*sy*cx + sz*sx, 0},
+        {sz*cy, -sz*sy*sx + cz*cx, -sz*sy*cx - cz*sx, 0},
+        {sy,    cy*sx,             cy*cx,             0},
+    }};
+    Vector3 d = apply3d(&m, *o);
+    m.m[0][3] = o->x - d.x;
+    m.m[1][3] = o->y - d.y;
+    m.m[2][3] = o->z - d.z;
+    return m;
+}
+
 static Vector3 *rot3d(Vector3 *p, Vector3 *o, Vector3 *t)
 {
-    if (t->x){
-        Vector2 r = rot2d(vector2(o->y, o->z), vector2(p->y, p->z), t->x);
-        p->y = r.x;
-        p->z = r.y;
+    Matrix m = rotation3d(o, t);
+    *p = apply3d(&m, *p);
+    return p;
+}
+
+/* Bounds */
+
+static void spherebounds(Mesh *m)
+{
+    Vector3 d = vector3(m->bmax.x - m->bmin.x, m->bmax.y - m->bmin.y, m->bmax.z - m->bmin.z);
+    set3d(&m->center, m->bmin.x + d.x/2, m->bmin.y + d.y/2, m->bmin.z + d.z/2);
+    m->radius = sqrtf(d.x*d.x + d.y*d.y + d.z*d.z) / 2;
+}
+
+static void growbounds(Mesh *m, Vector3 v)
+{
+    if (m->vert_len == 0) {
+        m->bmin = m->bmax = v;
     }
-    if (t->y){
-        Vector2 r = rot2d(vector2(o->x, o->z), vector2(p->x, p->z), t->y);
-        p->x = r.x;
-        p->z = r.y;
+    else {
+        set3d(&m->bmin, fminf(m->bmin.x, v.x), fminf(m->bmin.y, v.y), fminf(m->bmin.z, v.z));
+        set3d(&m->bmax, fmaxf(m->bmax.x, v.x), fmaxf(m->bmax.y, v.y), fmaxf(m->bmax.z, v.z));
     }
-    if (t->z){
-        Vector2 r = rot2d(vector2(o->x, o->y), vector2(p->x, p->y), t->z);
-        p->x = r.x;
-        p->y = r.y;
+    spherebounds(m);
+    m->dirty = 1;
+}
+
+static void updatebounds(Mesh *m)
+{
+    int i;
+    m->dirty = 1;
+    if (m->vert_len == 0) return;
+    m->bmin = m->bmax = m->vertices[0];
+    for (i=1; i<m->vert_len; i++) {
+        Vector3 v = m->vertices[i];
+        set3d(&m->bmin, fminf(m->bmin.x, v.x), fminf(m->bmin.y, v.y), fminf(m->bmin.z, v.z));
+        set3d(&m->bmax, fmaxf(m->bmax.x, v.x), fmaxf(m->bmax.y, v.y), fmaxf(m->bmax.z, v.z));
     }
-    return p;
+    spherebounds(m);
 }
 
 /* Primitives */
 
-static Vector3 *addvertex(Mesh *m, float x, float y, float z)
+static uint32_t hash3i(int32_t x, int32_t y, int32_t z)
+{
+    uint32_t h = (uint32_t)x*0x8da6b343u ^ (uint32_t)y*0xd8163841u ^ (uint32_t)z*0xcb1ab31fu;
+    return h ^ (h >> 15);
+}
+
+/* Exact positions hash their bits (with -0 folded into 0 so equ3d() matches
+   hash alike); with an epsilon, the grid cell the position falls in. */
+static uint32_t weld_hash(Weld *w, Vector3 v, int dx, int dy, int dz)
+{
+    if (w->epsilon > 0)
+        return hash3i((int32_t)floorf(v.x / w->epsilon) + dx, (int32_t)floorf(v.y / w->epsilon) + dy, (int32_t)floorf(v.z / w->epsilon) + dz);
+    float x = v.x + 0.0f, y = v.y + 0.0f, z = v.z + 0.0f;
+    uint32_t bx, by, bz;
+    memcpy(&bx, &x, 4);
+    memcpy(&by, &y, 4);
+    memcpy(&bz, &z, 4);
+    return hash3i((int32_t)bx, (int32_t)by, (int32_t)bz);
+}
+
+static int weld_match(Weld *w, Vector3 a, Vector3 b)
+{
+    if (w->epsilon > 0)
+        return fabsf(a.x-b.x) <= w->epsilon && fabsf(a.y-b.y) <= w->epsilon && fabsf(a.z-b.z) <= w->epsilon;
+    return equ3d(a, b);
+}
+
+static void weld_insert(Weld *w, Vector3 *vertices, int i)
+{
+    uint32_t mask = w->cap - 1, h = weld_hash(w, vertices[i], 0, 0, 0) & mask;
+    while (w->slots[h]) h = (h + 1) & mask;
+    w->slots[h] = i + 1;
+}
+
+/* Drops the index, e.g. after the mesh's vertices moved. */
+static void weld_reset(Weld *w)
+{
+    if (w->slots) memset(w->slots, 0, w->cap * sizeof(int));
+    w->len = 0;
+}
+
+/* Brings the index up to date with m's vertices, growing it to stay at most half full. */
+static void weld_sync(Mesh *m)
+{
+    Weld *w = &m->weld;
+    if (2*(m->vert_len + 1) > w->cap) {
+        int cap = w->cap ? w->cap : 64;
+        int *slots;
+        while (2*(m->vert_len + 1) > cap) cap *= 2;
+        if ((slots = arena_alloc(&arena, cap * sizeof(int))) == NULL) abort();
+        memset(slots, 0, cap * sizeof(int));
+        arena_release(&arena, w->slots, w->cap * sizeof(int));
+        w->slots = slots;
+        w->cap = cap;
+        w->len = 0;
+    }
+    for (; w->len < m->vert_len; w->len++)
+        weld_insert(w, m->vertices, w->len);
+}
+
+/* Index of a vertex of m matching v, or -1. */
+static int weld_find(Mesh *m, Vector3 v)
+{
+    Weld *w = &m->weld;
+    uint32_t mask = w->cap - 1;
+    int dx, dy, dz, n = w->epsilon > 0 ? 1 : 0;
+    for (dx=-n; dx<=n; dx++)
+        for (dy=-n; dy<=n; dy++)
+            for (dz=-n; dz<=n; dz++) {
+                uint32_t h = weld_hash(w, v, dx, dy, dz) & mask;
+                for (; w->slots[h]; h = (h + 1) & mask)
+                    if (weld_match(w, m->vertices[w->slots[h] - 1], v))
+                        return w->slots[h] - 1;
+            }
+    return -1;
+}
+
+/* Sets how far apart two vertices of m may be on each axis and still be
+   welded into one; 0 (the default) welds exact duplicates only. */
+static Mesh *setweld(Mesh *m, float epsilon)
+{
+    m->weld.epsilon = epsilon;
+    weld_reset(&m->weld);
+    return m;
+}
+
+static void reserve_vertices(Mesh *m, int n)
+{
+    int cap = m->vert_cap ? m->vert_cap : 16;
+    Vector3 *v;
+    if (n <= m->vert_cap) return;
+    while (cap < n) cap *= 2;
+    if ((v = arena_alloc(&arena, cap * sizeof(Vector3))) == NULL) abort();
+    if (m->vert_len) memcpy(v, m->vertices, m->vert_len * sizeof(Vector3));
+    arena_release(&arena, m->vertices, m->vert_cap * sizeof(Vector3));
+    m->vertices = v;
+    m->vert_cap = cap;
+}
+
+static void reserve_edges(Mesh *m, int n)
+{
+    int cap = m->edge_cap ? m->edge_cap : 16;
+    Edge *e;
+    uint32_t *c;
+    if (n <= m->edge_cap) return;
+    while (cap < n) cap *= 2;
+    e = arena_alloc(&arena, cap * sizeof(Edge));
+    c = arena_alloc(&arena, cap * sizeof(uint32_t));
+    if (e == NULL || c == NULL) abort();
+    if (m->edge_len) {
+        memcpy(e, m->edges, m->edge_len * sizeof(Edge));
+        memcpy(c, m->colors, m->edge_len * sizeof(uint32_t));
+    }
+    arena_release(&arena, m->edges, m->edge_cap * sizeof(Edge));
+    arena_release(&arena, m->colors, m->edge_cap * sizeof(uint32_t));
+    m->edges = e;
+    m->colors = c;
+    m->edge_cap = cap;
+}
+
+static uint32_t addvertex(Mesh *m, float x, float y, float z)
 {
     int i;
     Vector3 v = vector3(x,y,z);
     translate3d(&v, &scene.position);
     scale3d(&v, &scene.scale);
     rot3d(&v, &scene.position, &scene.rotation);
-    for (i=0; i < m->vert_len; ++i)
-        if (equ3d(m->vertices[i], v))
-            return &m->vertices[i];
-    m->vert_len++;
-    return set3d(_vertices++, v.x, v.y, v.z);
+    weld_sync(m);
+    if ((i = weld_find(m, v)) >= 0)
+        return i;
+    reserve_vertices(m, m->vert_len + 1);
+    growbounds(m, v);
+    set3d(&m->vertices[m->vert_len], v.x, v.y, v.z);
+    return m->vert_len++;
 }
 
-static Edge *addedge(Mesh *m, Vector3 *a, Vector3 *b, uint32_t color)
+static void reserve_faces(Mesh *m, int n)
 {
-    _edges->a = a;
-    _edges->b = b;
-    _edges->color = color;
-    m->edge_len++;
-    return _edges++;
+    int cap = m->face_cap ? m->face_cap : 16;
+    Face *f;
+    uint32_t *c;
+    if (n <= m->face_cap) return;
+    while (cap < n) cap *= 2;
+    f = arena_alloc(&arena, cap * sizeof(Face));
+    c = arena_alloc(&arena, cap * sizeof(uint32_t));
+    if (f == NULL || c == NULL) abort();
+    if (m->face_len) {
+        memcpy(f, m->faces, m->face_len * sizeof(Face));
+        memcpy(c, m->face_colors, m->face_len * sizeof(uint32_t));
+    }
+    arena_release(&arena, m->faces, m->face_cap * sizeof(Face));
+    arena_release(&arena, m->face_colors, m->face_cap * sizeof(uint32_t));
+    m->faces = f;
+    m->face_colors = c;
+    m->face_cap = cap;
+}
+
+static Edge *addedge(Mesh *m, uint32_t a, uint32_t b, uint32_t color)
+{
+    Edge *e;
+    reserve_edges(m, m->edge_len + 1);
+    m->dirty = 1;
+    m->colors[m->edge_len] = color;
+    e = &m->edges[m->edge_len++];
+    e->a = a;
+    e->b = b;
+    return e;
+}
+
+static Face *addface(Mesh *m, uint32_t a, uint32_t b, uint32_t c, uint32_t color)
+{
+    Face *f;
+    reserve_faces(m, m->face_len + 1);
+    m->dirty = 1;
+    m->face_colors[m->face_len] = color;
+    f = &m->faces[m->face_len++];
+    f->a = a;
+    f->b = b;
+    f->c = c;
+    return f;
 }
 
 static Mesh *addline(Mesh *m, Vector3 a, Vector3 b, uint32_t color)
 {
-    addedge(m, addvertex(m, a.x, a.y, a.z), addvertex(m, b.x, b.y, b.z), color);
+    uint32_t ia = addvertex(m, a.x, a.y, a.z);
+    uint32_t ib = addvertex(m, b.x, b.y, b.z);
+    addedge(m, ia, ib, color);
     return m;
 }
 
+/* Topology */
+
+#define NOFACE UINT32_MAX
+
+/* Side k of face f as side = 3*f + k, keyed by its corners in ascending
+   order; flip is set when the face walks it from hi to lo. */
+typedef struct {
+    uint32_t lo, hi, side, flip;
+} Side;
+
+static int cmpside(const void *a, const void *b)
+{
+    const Side *p = a, *q = b;
+    if (p->lo != q->lo) return p->lo < q->lo ? -1 : 1;
+    if (p->hi != q->hi) return p->hi < q->hi ? -1 : 1;
+    return p->side < q->side ? -1 : p->side > q->side;
+}
+
+static int cmpkey(const void *a, const void *b)
+{
+    const Side *p = a, *q = b;
+    if (p->lo != q->lo) return p->lo < q->lo ? -1 : 1;
+    return p->hi < q->hi ? -1 : p->hi > q->hi;
+}
+
+static void flipface(Face *f)
+{
+    uint32_t t = f->b;
+    f->b = f->c;
+    f->c = t;
+}
+
+/* Makes the windings of m's faces agree across shared sides, turns closed
+   shells outward (positive signed volume) and records which faces meet at
+   each edge. Faces are walked shell by shell from a seed, flipping each
+   neighbour to run the shared side opposite to the face it came from. */
+static void meshtopology(Mesh *m)
+{
+    int i, k, n = 3 * m->face_len, top;
+    Side *sides = arena_alloc(&arena, n * sizeof(Side) + 1);
+    uint32_t *partner = arena_alloc(&arena, n * sizeof(uint32_t) + 1);
+    int *shell = arena_alloc(&arena, m->face_len * sizeof(int) + 1);
+    int *stack = arena_alloc(&arena, m->face_len * sizeof(int) + 1);
+    unsigned char *flipped = arena_alloc(&arena, m->face_len + 1);
+    double *volume = arena_alloc(&arena, m->face_len * sizeof(double) + 1);
+    if (!sides || !partner || !shell || !stack || !flipped || !volume) abort();
+
+    for (i = 0; i < m->face_len; i++) {
+        uint32_t v[3] = {m->faces[i].a, m->faces[i].b, m->faces[i].c};
+        for (k = 0; k < 3; k++) {
+            uint32_t a = v[k], b = v[(k + 1) % 3];
+            sides[3*i + k] = (Side){a < b ? a : b, a < b ? b : a, 3*i + k, a > b};
+        }
+    }
+    qsort(sides, n, sizeof(Side), cmpside);
+    m->closed = m->face_len > 0;
+    for (i = 0; i < n; i++)
+        partner[i] = NOFACE;
+    for (i = 0; i < n; i = k) {
+        for (k = i + 1; k < n && !cmpkey(&sides[i], &sides[k]); k++);
+        if (k - i == 2) {
+            partner[sides[i].side] = i + 1;
+            partner[sides[i + 1].side] = i;
+        }
+        else m->closed = 0;
+    }
+    /* partner[3*f + k] is the sorted position of the side face f shares on
+       its side k, so partner[sides[q].side] leads back to f's own entry. */
+    for (i = 0; i < m->face_len; i++)
+        shell[i] = -1;
+    for (i = 0; i < m->face_len; i++) {
+        if (shell[i] >= 0) continue;
+        shell[i] = i;
+        flipped[i] = 0;
+        volume[i] = 0;
+        stack[0] = i;
+        top = 1;
+        while (top) {
+            int f = stack[--top];
+            for (k = 0; k < 3; k++) {
+                uint32_t q = partner[3*f + k], g, want;
+                if (q == NOFACE) continue;
+                g = sides[q].side / 3;
+                want = sides[partner[sides[q].side]].flip ^ sides[q].flip ^ flipped[f] ^ 1;
+                if (shell[g] < 0) {
+                    shell[g] = i;
+                    flipped[g] = want;
+                    stack[top++] = g;
+                }
+                else if (flipped[g] != want) m->closed = 0;
+            }
+        }
+    }
+    for (i = 0; i < m->face_len; i++) {
+        Face *f = &m->faces[i];
+        Vector3 a, b, c;
+        if (flipped[i]) flipface(f);
+        a = m->vertices[f->a], b = m->vertices[f->b], c = m->vertices[f->c];
+        volume[shell[i]] += (double)a.x*(b.y*c.z - b.z*c.y) + (double)a.y*(b.z*c.x - b.x*c.z) + (double)a.z*(b.x*c.y - b.y*c.x);
+    }
+    if (m->closed)
+        for (i = 0; i < m->face_len; i++)
+            if (volume[shell[i]] < 0) flipface(&m->faces[i]);
+
+    arena_release(&arena, m->edge_faces, 2 * m->topo_edges * sizeof(uint32_t));
+    if ((m->edge_faces = arena_alloc(&arena, 2 * m->edge_len * sizeof(uint32_t))) == NULL) abort();
+    for (i = 0; i < m->edge_len; i++) {
+        Edge e = m->edges[i];
+        Side key = {e.a < e.b ? e.a : e.b, e.a < e.b ? e.b : e.a, 0, 0};
+        Side *s = bsearch(&key, sides, n, sizeof(Side), cmpkey);
+        m->edge_faces[2*i] = m->edge_faces[2*i + 1] = NOFACE;
+        if (s == NULL || partner[s->side] == NOFACE) continue;
+        m->edge_faces[2*i] = s->side / 3;
+        m->edge_faces[2*i + 1] = sides[partner[s->side]].side / 3;
+    }
+    m->topo_edges = m->edge_len;
+    m->topo_faces = m->face_len;
+
+    arena_release(&arena, volume, m->face_len * sizeof(double) + 1);
+    arena_release(&arena, flipped, m->face_len + 1);
+    arena_release(&arena, stack, m->face_len * sizeof(int) + 1);
+    arena_release(&arena, shell, m->face_len * sizeof(int) + 1);
+    arena_release(&arena, partner, n * sizeof(uint32_t) + 1);
+    arena_release(&arena, sides, n * sizeof(Side) + 1);
+}
+
+/* Timing */
+
+#define TIMING_FRAMES 256
+
+enum { STAGE_CLEAR, STAGE_TRANSFORM, STAGE_RASTER, STAGE_UPLOAD, STAGE_PRESENT, STAGE_COUNT };
+
+#ifndef TRINKET_NO_MAIN
+static const char *stage_names[STAGE_COUNT] = {"clear", "transform", "raster", "upload", "present"};
+#endif
+static const uint32_t stage_colors[STAGE_COUNT] = {0xff808080, 0xff00c0ff, 0xffffff00, 0xffff00ff, 0xff0000ff};
+
+/* Per-stage nanoseconds for the last TIMING_FRAMES frames; slot frame%TIMING_FRAMES is being filled. */
+typedef struct {
+    uint64_t stage[TIMING_FRAMES][STAGE_COUNT];
+    uint64_t total[STAGE_COUNT];
+    uint64_t frame, mark;
+    int drawn, culled;                  /* meshes this frame */
+    uint64_t total_drawn, total_culled;
+    FILE *csv;
+    int hud;
+} Timing;
+
+static Timing timing;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void stage_begin(void)
+{
+    timing.mark = now_ns();
+}
+
+static void stage_end(int stage)
+{
+    uint64_t t = now_ns();
+    timing.stage[timing.frame % TIMING_FRAMES][stage] += t - timing.mark;
+    timing.mark = t;
+}
+
+#ifndef TRINKET_NO_MAIN
+static void frame_end(void)
+{
+    int i;
+    uint64_t *st = timing.stage[timing.frame % TIMING_FRAMES], sum = 0;
+    if (timing.csv) fprintf(timing.csv, "%llu", (unsigned long long)timing.frame);
+    for (i=0; i<STAGE_COUNT; i++) {
+        timing.total[i] += st[i];
+        sum += st[i];
+        if (timing.csv) fprintf(timing.csv, ",%llu", (unsigned long long)st[i]);
+    }
+    if (timing.csv) fprintf(timing.csv, ",%llu,%d,%d\n", (unsigned long long)sum, timing.drawn, timing.culled);
+    timing.total_drawn += timing.drawn;
+    timing.total_culled += timing.culled;
+    timing.frame++;
+    memset(timing.stage[timing.frame % TIMING_FRAMES], 0, sizeof(timing.stage[0]));
+}
+
+static int open_csv(const char *path)
+{
+    int i;
+    timing.csv = fopen(path, "w");
+    if (timing.csv == NULL) return 0;
+    fprintf(timing.csv, "frame");
+    for (i=0; i<STAGE_COUNT; i++)
+        fprintf(timing.csv, ",%s_ns", stage_names[i]);
+    fprintf(timing.csv, ",total_ns,meshes_drawn,meshes_culled\n");
+    return 1;
+}
+#endif
+
 /* Drawing */
 
-static void clear(uint32_t *dst)
+/* Solid frames draw faces against zbuffer. Hidden-line frames lay the faces
+   down in zbuffer only and then draw the edges that are not behind them,
+   scaling edge depth up by LINE_BIAS so edges win over their own faces.
+   Either way zbuffer is cleared along with the color. Input flips solid and
+   hidden; latch() copies them into draw_solid and draw_hidden (and the HUD
+   switch into draw_hud, the camera into draw_cam), which is all the drawing
+   code looks at, so a frame on the render thread keeps one mode and one
+   view throughout. */
+static int solid, hidden;
+static int draw_solid, draw_hidden, draw_hud;
+static Camera draw_cam;
+
+#define LINE_BIAS 0.01f
+
+/* c and d cover the same pixels. */
+static void clear(Canvas c, Depth_Canvas d)
+{
+    jgl_fill(c, BGCOLOR);
+    if (draw_solid || draw_hidden) jgl_depth_clear(d);
+}
+
+/* What the next frame has to draw again: everything when redraw is set,
+   otherwise the screen under each dirty mesh where it was and where it is
+   now, plus damaged, which collects the boxes of meshes removed since.
+   latch() folds both into stale, as does setsize(), for damage() to take. */
+static int redraw = 1;
+static Box damaged, stale;
+
+static int boxempty(Box b)
+{
+    return b.x0 >= b.x1 || b.y0 >= b.y1;
+}
+
+static Box boxunion(Box a, Box b)
+{
+    if (boxempty(a)) return b;
+    if (boxempty(b)) return a;
+    return (Box){a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+                 a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1};
+}
+
+/* Cuts the view-space segment ab at the near plane (depth z + range = NEAR).
+   Returns 0 when all of it is behind. */
+static int clipnear(Vector3 *a, Vector3 *b, float range)
+{
+    float da = a->z + range, db = b->z + range, t;
+    if (da < NEAR && db < NEAR) return 0;
+    if (da < NEAR) {
+        t = (NEAR - da) / (db - da);
+        set3d(a, a->x + (b->x - a->x)*t, a->y + (b->y - a->y)*t, a->z + (b->z - a->z)*t);
+    }
+    else if (db < NEAR) {
+        t = (NEAR - db) / (da - db);
+        set3d(b, b->x + (a->x - b->x)*t, b->y + (a->y - b->y)*t, b->z + (a->z - b->z)*t);
+    }
+    return 1;
+}
+
+/* Liang-Barsky: trims p1p2 to the rectangle [x0, x1] x [y0, y1], moving the
+   depths in z (which vary linearly along it) with the ends. Segments already
+   inside are left bit-for-bit alone. Returns 0 when nothing is left. */
+static int clipline(Vector2 *p1, Vector2 *p2, float z[2], float x0, float y0, float x1, float y1)
+{
+    int i;
+    double t0 = 0, t1 = 1, dx = p2->x - p1->x, dy = p2->y - p1->y, dz = z[1] - z[0];
+    double p[4] = {-dx, dx, -dy, dy};
+    double q[4] = {p1->x - x0, x1 - p1->x, p1->y - y0, y1 - p1->y};
+
+    if (p1->x >= x0 && p1->x <= x1 && p1->y >= y0 && p1->y <= y1 &&
+        p2->x >= x0 && p2->x <= x1 && p2->y >= y0 && p2->y <= y1)
+        return 1;
+    for (i=0; i<4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) return 0;
+        }
+        else if (p[i] < 0) {
+            if (q[i]/p[i] > t1) return 0;
+            if (q[i]/p[i] > t0) t0 = q[i]/p[i];
+        }
+        else {
+            if (q[i]/p[i] < t0) return 0;
+            if (q[i]/p[i] < t1) t1 = q[i]/p[i];
+        }
+    }
+    *p2 = vector2(p1->x + t1*dx, p1->y + t1*dy);
+    *p1 = vector2(p1->x + t0*dx, p1->y + t0*dy);
+    z[1] = z[0] + t1*dz;
+    z[0] = z[0] + t0*dz;
+    return 1;
+}
+
+/* A projected edge in whole pixels, ready for jgl_plot_line(); both ends lie
+   on the canvas. z1/z2 are the ends' depths 1/(z + range). */
+typedef struct {
+    int x1, y1, x2, y2;
+    float z1, z2;
+    uint32_t color;
+} Line;
+
+/* A projected face with corners in jgl fixed point and depths 1/(z + range),
+   ready for jgl_fill_triangle3z_fixed(). */
+typedef struct {
+    int x[3], y[3];
+    float z[3];
+    uint32_t color;
+} Triangle;
+
+/* Stacked per-stage bars for the frames in the timing ring, newest on the
+   right, over a translucent panel. The guide line marks 16.6 ms. */
+static void drawhud(Canvas c)
+{
+    const int x0 = 32, y0 = 32, bar = 4, h = 240;
+    const double ns_per_px = 33.3e6 / h;
+    int i, s, n = timing.frame < TIMING_FRAMES ? (int)timing.frame : TIMING_FRAMES;
+
+    jgl_fill_rect(c, x0 - 8, y0 - 8, TIMING_FRAMES*bar + 16, h + 16 + 12*STAGE_COUNT + 8, 0xc0000000);
+    for (i=0; i<n; i++) {
+        uint64_t *st = timing.stage[(timing.frame - n + i) % TIMING_FRAMES];
+        int x = x0 + (TIMING_FRAMES - n + i)*bar, y = y0 + h;
+        for (s=0; s<STAGE_COUNT; s++) {
+            int len = (int)(st[s] / ns_per_px);
+            if (len > y - y0) len = y - y0;
+            y -= len;
+            jgl_fill_rect(c, x, y, bar - 1, len, stage_colors[s]);
+        }
+    }
+    jgl_plot_line(c, x0, y0 + h/2, x0 + TIMING_FRAMES*bar, y0 + h/2, 0xffffffff);
+
+    /* legend: one bar per stage, length is the mean over the ring */
+    for (s=0; s<STAGE_COUNT; s++) {
+        uint64_t sum = 0;
+        for (i=0; i<n; i++)
+            sum += timing.stage[(timing.frame - n + i) % TIMING_FRAMES][s];
+        int len = n ? (int)(sum / n / (ns_per_px / 4)) : 0;
+        if (len > TIMING_FRAMES*bar) len = TIMING_FRAMES*bar;
+        jgl_fill_rect(c, x0, y0 + h + 8 + 12*s, len, 8, stage_colors[s]);
+    }
+}
+
+/* Screen-space position and depth (z + range) of every scene vertex for the
+   current frame, mesh after mesh; a mesh's vertex i lives at [base + i].
+   Positions are garbage for depths below NEAR. views[i] is the view matrix
+   used for mesh i; visible[i] is 0 when the mesh was culled and its slots
+   were not filled. */
+static float *screen_x, *screen_y, *screen_d;
+static int screen_cap;
+static Matrix *views;
+static unsigned char *visible;
+static int views_cap;
+static int cull = 1;
+
+/* Applies m to n vertices and projects them with cam_project(). */
+static void project_scalar(Matrix *m, Camera *c, Vector3 *v, int n, float *sx, float *sy, float *sd)
+{
+    int i;
+    for (i=0; i<n; i++) {
+        Vector3 q = apply3d(m, v[i]);
+        Vector2 p = cam_project(c, q);
+        sx[i] = p.x;
+        sy[i] = p.y;
+        sd[i] = q.z + c->range;
+    }
+}
+
+#ifdef JGL_X86
+/* Four vertices per iteration: three loads of packed xyz are shuffled into
+   x, y and z lanes. Same operation order as project_scalar(). */
+__attribute__((target("sse2")))
+static void project_sse2(Matrix *m, Camera *cm, Vector3 *v, int n, float *sx, float *sy, float *sd)
+{
+    int i;
+    __m128 m00 = _mm_set1_ps(m->m[0][0]), m01 = _mm_set1_ps(m->m[0][1]), m02 = _mm_set1_ps(m->m[0][2]), m03 = _mm_set1_ps(m->m[0][3]);
+    __m128 m10 = _mm_set1_ps(m->m[1][0]), m11 = _mm_set1_ps(m->m[1][1]), m12 = _mm_set1_ps(m->m[1][2]), m13 = _mm_set1_ps(m->m[1][3]);
+    __m128 m20 = _mm_set1_ps(m->m[2][0]), m21 = _mm_set1_ps(m->m[2][1]), m22 = _mm_set1_ps(m->m[2][2]), m23 = _mm_set1_ps(m->m[2][3]);
+    __m128 rng = _mm_set1_ps(cm->range), k = _mm_set1_ps(focal), cx = _mm_set1_ps(width/2), cy = _mm_set1_ps(height/2);
+    for (i=0; i+4<=n; i+=4) {
+        float *f = &v[i].x;
+        __m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f+4), c = _mm_loadu_ps(f+8);
+        __m128 xy = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,1,3,2));
+        __m128 yz = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1,0,2,1));
+        __m128 x = _mm_shuffle_ps(a, xy, _MM_SHUFFLE(2,0,3,0));
+        __m128 y = _mm_shuffle_ps(yz, xy, _MM_SHUFFLE(3,1,2,0));
+        __m128 z = _mm_shuffle_ps(yz, c, _MM_SHUFFLE(3,0,3,1));
+        __m128 px = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m01, y)), _mm_mul_ps(m02, z)), m03);
+        __m128 py = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, x), _mm_mul_ps(m11, y)), _mm_mul_ps(m12, z)), m13);
+        __m128 pz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, x), _mm_mul_ps(m21, y)), _mm_mul_ps(m22, z)), m23);
+        __m128 d = _mm_add_ps(pz, rng);
+        __m128 r = _mm_div_ps(k, d);
+        _mm_storeu_ps(sx + i, _mm_add_ps(cx, _mm_mul_ps(r, px)));
+        _mm_storeu_ps(sy + i, _mm_add_ps(cy, _mm_mul_ps(r, py)));
+        _mm_storeu_ps(sd + i, d);
+    }
+    project_scalar(m, cm, v + i, n - i, sx + i, sy + i, sd + i);
+}
+#define project project_sse2
+#else
+#define project project_scalar
+#endif
+
+/* Whether a sphere at view-space c may be seen: it must reach in front of
+   the near plane and inside the four side planes of the view pyramid, which
+   pass through the eye at depth 0 and the canvas edges at depth focal. */
+static int insidefrustum(Vector3 c, float r)
+{
+    const float kx = (width/2) / focal, ky = (height/2) / focal;
+    float d = c.z + draw_cam.range;
+    if (d < NEAR - r) return 0;
+    if ((fabsf(c.x) - kx*d) > r * sqrtf(1 + kx*kx)) return 0;
+    if ((fabsf(c.y) - ky*d) > r * sqrtf(1 + ky*ky)) return 0;
+    return 1;
+}
+
+/* Pixels that the n projected vertices from base can touch: their bounding
+   box with a pixel of slack for rounding, or the whole screen when any of
+   them is behind the near plane. */
+static Box screenbox(int base, int n)
 {
-    for (int i; i<WIDTH*HEIGHT; ++i)
-        dst[i] = BGCOLOR;
+    float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+    int i;
+    if (n == 0) return (Box){0, 0, 0, 0};
+    for (i = base; i < base + n; i++) {
+        if (screen_d[i] < NEAR) return (Box){0, 0, width, height};
+        x0 = fminf(x0, screen_x[i]);
+        y0 = fminf(y0, screen_y[i]);
+        x1 = fmaxf(x1, screen_x[i]);
+        y1 = fmaxf(y1, screen_y[i]);
+    }
+    return (Box){(int)fmaxf(floorf(x0) - 1, 0), (int)fmaxf(floorf(y0) - 1, 0),
+                 (int)fminf(ceilf(x1) + 2, width), (int)fminf(ceilf(y1) + 2, height)};
 }
 
-static void drawline(uint32_t *dst, Vector2 p1, Vector2 p2, uint32_t color)
+/* Builds one matrix per mesh (mesh offset, camera rotation about its
+   origin, then the origin offset again, as draw() always did) and runs it
+   over the mesh's vertices. */
+static void transform(void)
 {
-    int x1 = (int)p1.x, y1 = (int)p1.y, x2 = (int)p2.x, y2 = (int)p2.y;
-    int dx = abs(x2-x1), sx = x1 < x2 ? 1 : -1;
-    int dy = -abs(y2-y1), sy = y1 < y2 ? 1 : -1;
-    int err = dx + dy, e2;
+    int i, base;
+    Matrix view = rotation3d(&draw_cam.origin, &draw_cam.rotation);
+    for (i = 0, base = 0; i < scene.len; i++)
+        base += scene.meshes[i]->vert_len;
+    if (base > screen_cap) {
+        screen_cap = base;
+        screen_x = realloc(screen_x, screen_cap * sizeof(float));
+        screen_y = realloc(screen_y, screen_cap * sizeof(float));
+        screen_d = realloc(screen_d, screen_cap * sizeof(float));
+        if (screen_x == NULL || screen_y == NULL || screen_d == NULL) abort();
+    }
+    if (scene.len > views_cap) {
+        views_cap = scene.len;
+        views = realloc(views, views_cap * sizeof(Matrix));
+        visible = realloc(visible, views_cap);
+        if (views == NULL || visible == NULL) abort();
+    }
+    timing.drawn = timing.culled = 0;
+    for (i = 0, base = 0; i < scene.len; i++) {
+        Mesh *m = scene.meshes[i];
+        Matrix t = {{{1, 0, 0, m->position.x}, {0, 1, 0, m->position.y}, {0, 0, 1, m->position.z}}};
+        Matrix mv = mult_mat(&view, &t);
+        mv.m[0][3] += draw_cam.origin.x;
+        mv.m[1][3] += draw_cam.origin.y;
+        mv.m[2][3] += draw_cam.origin.z;
+        views[i] = mv;
+        visible[i] = !cull || insidefrustum(apply3d(&mv, m->center), m->radius);
+        if (visible[i]) {
+            if (m->topo_edges != m->edge_len || m->topo_faces != m->face_len)
+                meshtopology(m);
+            project(&mv, &draw_cam, m->vertices, m->vert_len, screen_x + base, screen_y + base, screen_d + base);
+            m->box = screenbox(base, m->vert_len);
+            timing.drawn++;
+        }
+        else {
+            m->box = (Box){0, 0, 0, 0};
+            timing.culled++;
+        }
+        base += m->vert_len;
+    }
+}
+
+/* Screen line for edge j of mesh i, whose vertices start at base in the
+   screen cache. Edges crossing the near plane are cut in view space and
+   reprojected, then everything is clipped to the canvas so raster cost is
+   bounded by what is visible. Returns 0 when nothing is left. */
+static int edgeline(int i, int base, int j, Line *l)
+{
+    Mesh *m = scene.meshes[i];
+    Edge e = m->edges[j];
+    int a = base + e.a, b = base + e.b;
+    Vector2 p1, p2;
+    float z[2];
+
+    if (screen_d[a] >= NEAR && screen_d[b] >= NEAR) {
+        p1 = vector2(screen_x[a], screen_y[a]);
+        p2 = vector2(screen_x[b], screen_y[b]);
+        z[0] = 1 / screen_d[a];
+        z[1] = 1 / screen_d[b];
+    }
+    else {
+        Vector3 va = apply3d(&views[i], m->vertices[e.a]);
+        Vector3 vb = apply3d(&views[i], m->vertices[e.b]);
+        if (!clipnear(&va, &vb, draw_cam.range)) return 0;
+        p1 = cam_project(&draw_cam, va);
+        p2 = cam_project(&draw_cam, vb);
+        z[0] = 1 / (va.z + draw_cam.range);
+        z[1] = 1 / (vb.z + draw_cam.range);
+    }
+    if (!clipline(&p1, &p2, z, 0, 0, width - 1, height - 1)) return 0;
+    *l = (Line){(int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, z[0], z[1], m->colors[j]};
+    return 1;
+}
+
+/* Screen triangles for face j of mesh i: the face itself, or what is left of
+   it in front of the near plane (a triangle or a quad split in two). Returns
+   how many went into t. */
+static int facetris(int i, int base, int j, Triangle t[2])
+{
+    Mesh *m = scene.meshes[i];
+    Face f = m->faces[j];
+    uint32_t v[3] = {base + f.a, base + f.b, base + f.c};
+    Vector2 p[4];
+    float z[4];
+    int k, n = 0;
+
+    if (screen_d[v[0]] >= NEAR && screen_d[v[1]] >= NEAR && screen_d[v[2]] >= NEAR) {
+        for (k = 0; k < 3; k++) {
+            p[k] = vector2(screen_x[v[k]], screen_y[v[k]]);
+            z[k] = 1 / screen_d[v[k]];
+        }
+        n = 3;
+    }
+    else {
+        Vector3 q[3] = {
+            apply3d(&views[i], m->vertices[f.a]),
+            apply3d(&views[i], m->vertices[f.b]),
+            apply3d(&views[i], m->vertices[f.c]),
+        };
+        for (k = 0; k < 3; k++) {
+            Vector3 a = q[k], b = q[(k + 1) % 3];
+            float da = a.z + draw_cam.range, db = b.z + draw_cam.range;
+            if (da >= NEAR) {
+                p[n] = cam_project(&draw_cam, a);
+                z[n++] = 1 / da;
+            }
+            if ((da >= NEAR) != (db >= NEAR)) {
+                float s = (NEAR - da) / (db - da);
+                p[n] = cam_project(&draw_cam, vector3(a.x + (b.x - a.x)*s, a.y + (b.y - a.y)*s, NEAR - draw_cam.range));
+                z[n++] = 1 / NEAR;
+            }
+        }
+        if (n < 3) return 0;
+    }
+    for (k = 0; k < n; k++)
+        if (fabsf(p[k].x) > 1 << 24 || fabsf(p[k].y) > 1 << 24) return 0;
+    for (k = 0; k < n - 2; k++) {
+        int c[3] = {0, k + 1, k + 2}, e;
+        for (e = 0; e < 3; e++) {
+            t[k].x[e] = (int)lrintf(p[c[e]].x * JGL_SUBPIXEL);
+            t[k].y[e] = (int)lrintf(p[c[e]].y * JGL_SUBPIXEL);
+            t[k].z[e] = z[c[e]];
+        }
+        t[k].color = m->face_colors[j];
+    }
+    return n - 2;
+}
+
+/* The frame's primitives in draw order: triangles for the faces of visible
+   meshes in solid and hidden-line modes, lines for their edges in wire and
+   hidden-line modes. */
+static Line *lines;
+static Triangle *tris;
+static int line_len, line_cap, tri_len, tri_cap;
+
+/* front[j] tells whether face j of the mesh being collected faces the eye. */
+static unsigned char *front;
+static int front_cap;
+
+/* Fills front[] for mesh i and returns whether its back faces may be
+   dropped, which needs a closed mesh. The eye is taken into the mesh's own
+   frame (views[i] is a rotation plus offset, so its inverse is the
+   transpose) and each face is tested against it there. */
+static int facing(int i)
+{
+    Mesh *m = scene.meshes[i];
+    Matrix *v = &views[i];
+    Vector3 e, a, b, c;
+    float t[3];
+    int j, r;
+
+    if (!cull || !m->closed) return 0;
+    if (m->face_len > front_cap) {
+        front_cap = m->face_len;
+        if ((front = realloc(front, front_cap)) == NULL) abort();
+    }
+    for (r = 0; r < 3; r++)
+        t[r] = (r == 2 ? -draw_cam.range : 0) - v->m[r][3];
+    e = vector3(v->m[0][0]*t[0] + v->m[1][0]*t[1] + v->m[2][0]*t[2],
+                v->m[0][1]*t[0] + v->m[1][1]*t[1] + v->m[2][1]*t[2],
+                v->m[0][2]*t[0] + v->m[1][2]*t[1] + v->m[2][2]*t[2]);
+    for (j = 0; j < m->face_len; j++) {
+        a = m->vertices[m->faces[j].a];
+        b = m->vertices[m->faces[j].b];
+        c = m->vertices[m->faces[j].c];
+        b = vector3(b.x - a.x, b.y - a.y, b.z - a.z);
+        c = vector3(c.x - a.x, c.y - a.y, c.z - a.z);
+        a = vector3(e.x - a.x, e.y - a.y, e.z - a.z);
+        front[j] = (b.y*c.z - b.z*c.y)*a.x + (b.z*c.x - b.x*c.z)*a.y + (b.x*c.y - b.y*c.x)*a.z > 0;
+    }
+    return 1;
+}
+
+static void collect(void)
+{
+    int i, j, k, n, base;
+    Line l;
+    Triangle t[2];
+
+    line_len = tri_len = 0;
+    for (i = 0, base = 0; i < scene.len; i++) {
+        Mesh *m = scene.meshes[i];
+        int backs = visible[i] && facing(i);
+        if (visible[i] && (draw_solid || draw_hidden)) {
+            for (j = 0; j < m->face_len; j++) {
+                if (backs && !front[j]) continue;
+                n = facetris(i, base, j, t);
+                if (tri_len + n > tri_cap) {
+                    tri_cap = tri_cap ? 2*tri_cap : 1024;
+                    if ((tris = realloc(tris, tri_cap * sizeof(Triangle))) == NULL) abort();
+                }
+                for (k = 0; k < n; k++)
+                    tris[tri_len++] = t[k];
+            }
+        }
+        if (visible[i] && !draw_solid) {
+            for (j = 0; j < m->edge_len; j++) {
+                uint32_t *f = &m->edge_faces[2*j];
+                if (backs && f[0] != NOFACE && !front[f[0]] && !front[f[1]]) continue;
+                if (!edgeline(i, base, j, &l)) continue;
+                if (line_len == line_cap) {
+                    line_cap = line_cap ? 2*line_cap : 1024;
+                    if ((lines = realloc(lines, line_cap * sizeof(Line))) == NULL) abort();
+                }
+                lines[line_len++] = l;
+            }
+        }
+        base += m->vert_len;
+    }
+}
+
+/* Draws t into c and d, whose pixel (0, 0) is screen pixel (x, y); outside
+   solid mode only its depth is written. */
+static void drawtri(Canvas c, Depth_Canvas d, Triangle *t, int x, int y)
+{
+    int dx = x * JGL_SUBPIXEL, dy = y * JGL_SUBPIXEL;
+    if (draw_solid)
+        jgl_fill_triangle3z_fixed(c, d, t->x[0] - dx, t->y[0] - dy, t->x[1] - dx, t->y[1] - dy,
+                                  t->x[2] - dx, t->y[2] - dy, t->z[0], t->z[1], t->z[2], t->color);
+    else
+        jgl_triangle3z_fixed(d, t->x[0] - dx, t->y[0] - dy, t->x[1] - dx, t->y[1] - dy,
+                             t->x[2] - dx, t->y[2] - dy, t->z[0], t->z[1], t->z[2]);
+}
+
+/* Draws l the same way, depth-tested in hidden-line mode. */
+static void drawline(Canvas c, Depth_Canvas d, Line *l, int x, int y)
+{
+    if (draw_hidden)
+        jgl_plot_line_z(c, d, l->x1 - x, l->y1 - y, l->x2 - x, l->y2 - y, l->z1, l->z2, LINE_BIAS, l->color);
+    else
+        jgl_plot_line(c, l->x1 - x, l->y1 - y, l->x2 - x, l->y2 - y, l->color);
+}
+
+/* Tiles */
+
+#define TILE 64
+#define TILES_X ((width + TILE - 1) / TILE)
+#define TILES_Y ((height + TILE - 1) / TILE)
+#define TILE_COUNT (TILES_X * TILES_Y)
+
+/* (tile, item) pairs gathered in draw order, then sorted by tile without
+   disturbing that order, so overlaps within a tile resolve as in a serial
+   draw: tile t's items are item[start[t] .. start[t+1]-1]. start has room
+   for the tiles of a full-size frame. */
+typedef struct {
+    uint32_t *tile, *pair, *item;
+    int len, cap;
+    int *start;
+} Bins;
+
+static Bins linebins, tribins;
+
+static void binadd(Bins *b, int tile, uint32_t item)
+{
+    if (b->len == b->cap) {
+        b->cap = b->cap ? 2*b->cap : 4096;
+        b->tile = realloc(b->tile, b->cap * sizeof(uint32_t));
+        b->pair = realloc(b->pair, b->cap * sizeof(uint32_t));
+        b->item = realloc(b->item, b->cap * sizeof(uint32_t));
+        if (b->tile == NULL || b->pair == NULL || b->item == NULL) abort();
+    }
+    b->tile[b->len] = tile;
+    b->pair[b->len++] = item;
+}
+
+static void binsort(Bins *b)
+{
+    int i, t;
+    memset(b->start, 0, (TILE_COUNT + 1) * sizeof(int));
+    for (i = 0; i < b->len; i++)
+        b->start[b->tile[i] + 1]++;
+    for (t = 0; t < TILE_COUNT; t++)
+        b->start[t + 1] += b->start[t];
+    for (i = 0; i < b->len; i++)
+        b->item[b->start[b->tile[i]]++] = b->pair[i];
+    for (t = TILE_COUNT; t > 0; t--)
+        b->start[t] = b->start[t - 1];
+    b->start[0] = 0;
+}
+
+/* Records every tile the Bresenham walk of lines[index] passes through: per
+   tile column (row, for steep lines) the walk's extent across it gives the
+   rows it touches there. */
+static void binline(uint32_t index)
+{
+    Line *l = &lines[index];
+    int dx = abs(l->x2 - l->x1), dy = abs(l->y2 - l->y1), xmajor = dx >= dy;
+    int n = xmajor ? dx : dy, d = xmajor ? dy : dx;
+    int u1 = xmajor ? l->x1 : l->y1, u2 = xmajor ? l->x2 : l->y2, v1 = xmajor ? l->y1 : l->x1;
+    int sv = (xmajor ? l->y1 < l->y2 : l->x1 < l->x2) ? 1 : -1;
+    int ulo = u1 < u2 ? u1 : u2, uhi = u1 < u2 ? u2 : u1;
+    int a, b;
+
+    for (a = ulo / TILE; a <= uhi / TILE; a++) {
+        int s = a*TILE > ulo ? a*TILE : ulo, e = a*TILE + TILE-1 < uhi ? a*TILE + TILE-1 : uhi;
+        int va = v1 + sv*jgl_line_minor(n, d, abs(s - u1));
+        int vb = v1 + sv*jgl_line_minor(n, d, abs(e - u1));
+        if (va > vb) swap_int(&va, &vb);
+        for (b = va / TILE; b <= vb / TILE; b++)
+            binadd(&linebins, xmajor ? b*TILES_X + a : a*TILES_X + b, index);
+    }
+}
+
+/* Records the tiles under the bounding box of tris[index]. */
+static void bintri(uint32_t index)
+{
+    Triangle *t = &tris[index];
+    int k, tx, ty, x0 = t->x[0], x1 = t->x[0], y0 = t->y[0], y1 = t->y[0];
+    for (k = 1; k < 3; k++) {
+        if (t->x[k] < x0) x0 = t->x[k];
+        if (t->x[k] > x1) x1 = t->x[k];
+        if (t->y[k] < y0) y0 = t->y[k];
+        if (t->y[k] > y1) y1 = t->y[k];
+    }
+    x0 = x0 < 0 ? 0 : x0 / (TILE * JGL_SUBPIXEL);
+    y0 = y0 < 0 ? 0 : y0 / (TILE * JGL_SUBPIXEL);
+    x1 = x1 / (TILE * JGL_SUBPIXEL);
+    y1 = y1 / (TILE * JGL_SUBPIXEL);
+    if (x1 >= TILES_X) x1 = TILES_X - 1;
+    if (y1 >= TILES_Y) y1 = TILES_Y - 1;
+    for (ty = y0; ty <= y1; ty++)
+        for (tx = x0; tx <= x1; tx++)
+            binadd(&tribins, ty*TILES_X + tx, index);
+}
+
+static void binframe(void)
+{
+    int i;
+    linebins.len = tribins.len = 0;
+    for (i = 0; i < line_len; i++)
+        binline(i);
+    for (i = 0; i < tri_len; i++)
+        bintri(i);
+    binsort(&linebins);
+    binsort(&tribins);
+}
+
+/* The part of the screen the frame redraws, grown out to whole tiles so the
+   tiled and untiled paths touch the same pixels; dirty flags are cleared as
+   the frame takes them in. */
+static Box damage(void)
+{
+    Box b = stale;
+    int i;
+    if (draw_hud) b = (Box){0, 0, width, height};
+    for (i = 0; i < scene.len; i++) {
+        Mesh *m = scene.meshes[i];
+        if (m->dirty) b = boxunion(b, boxunion(m->shown, m->box));
+        m->shown = m->box;
+        m->dirty = 0;
+    }
+    stale = (Box){0, 0, 0, 0};
+    if (boxempty(b)) return b;
+    b.x0 = b.x0 / TILE * TILE;
+    b.y0 = b.y0 / TILE * TILE;
+    b.x1 = (b.x1 + TILE - 1) / TILE * TILE;
+    b.y1 = (b.y1 + TILE - 1) / TILE * TILE;
+    if (b.x1 > width) b.x1 = width;
+    if (b.y1 > height) b.y1 = height;
+    return b;
+}
+
+/* Clears tile t of c, which covers screen pixels b, (and of the depth buffer
+   when it is in use) and draws its primitives through sub-canvases, so
+   nothing outside the tile is touched. */
+static void rastertile(Canvas c, Box b, int t)
+{
+    int k, tx = t % TILES_X * TILE, ty = t / TILES_X * TILE;
+    Canvas sub = jgl_subcanvas(c, tx - b.x0, ty - b.y0, TILE, TILE);
+    Depth_Canvas d = jgl_depth_subcanvas(jgl_depth_canvas(zbuffer, hiz, width, height, screen_w), tx, ty, TILE, TILE);
+
+    jgl_fill(sub, BGCOLOR);
+    if (draw_solid || draw_hidden) jgl_depth_clear(d);
+    for (k = tribins.start[t]; k < tribins.start[t + 1]; k++)
+        drawtri(sub, d, &tris[tribins.item[k]], tx, ty);
+    for (k = linebins.start[t]; k < linebins.start[t + 1]; k++)
+        drawline(sub, d, &lines[linebins.item[k]], tx, ty);
+}
+
+/* Tile workers. rasterize() publishes a frame by bumping generation; every
+   thread, the caller included, then takes tiles off the shared cursor until
+   none are left, so a crowded tile never holds up the others. Tiles do not
+   overlap and the framebuffer needs no locking. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    uint64_t generation;
+    int count, busy;
+    atomic_int next;
+    Canvas canvas;
+    Box box;
+    int len, *tiles;                /* the tiles inside box */
+} Pool;
+
+static Pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+static int threads;         /* 0: one per online CPU, 1: untiled on the main thread */
+
+static void rastertiles(void)
+{
+    int t;
+    while ((t = atomic_fetch_add(&pool.next, 1)) < pool.len)
+        rastertile(pool.canvas, pool.box, pool.tiles[t]);
+}
+
+static void *tileworker(void *arg)
+{
+    uint64_t seen = 0;
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        rastertiles();
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/* Resolves threads and starts threads-1 workers. */
+static void startpool(void)
+{
+    pthread_t thread;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    for (pool.count = 0; pool.count < threads - 1; pool.count++) {
+        if (pthread_create(&thread, NULL, tileworker, NULL) != 0) break;
+        pthread_detach(thread);
+    }
+    threads = pool.count + 1;
+}
+
+/* rasterstart() hands the tiles inside b, which c covers, to the workers
+   and returns at once; rasterwait() joins in on whatever is left and
+   returns when all are done. */
+static void rasterstart(Canvas c, Box b)
+{
+    int x, y;
+    pthread_mutex_lock(&pool.lock);
+    pool.canvas = c;
+    pool.box = b;
+    pool.len = 0;
+    for (y = b.y0 / TILE; y < (b.y1 + TILE - 1) / TILE; y++)
+        for (x = b.x0 / TILE; x < (b.x1 + TILE - 1) / TILE; x++)
+            pool.tiles[pool.len++] = y*TILES_X + x;
+    atomic_store(&pool.next, 0);
+    pool.busy = pool.count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void rasterwait(void)
+{
+    rastertiles();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Frames are w x h from here on; the view is scaled with them. */
+static void setsize(int w, int h)
+{
+    width = w;
+    height = h;
+    focal = 500.0f * w / 3072;
+    stale = (Box){0, 0, w, h};
+}
+
+/* Sizes the framebuffer and everything kept per pixel or per tile. */
+static void allocscreen(int w, int h)
+{
+    size_t n = (size_t)w * h;
+    screen_w = w;
+    screen_h = h;
+    setsize(w, h);
+    pixels = calloc(n, sizeof(uint32_t));
+    zbuffer = calloc(n, sizeof(float));
+    hiz = calloc(JGL_HIZ_SIZE((size_t)w, (size_t)h), sizeof(float));
+    linebins.start = calloc(TILE_COUNT + 1, sizeof(int));
+    tribins.start = calloc(TILE_COUNT + 1, sizeof(int));
+    pool.tiles = calloc(TILE_COUNT, sizeof(int));
+    if (!pixels || !zbuffer || !hiz || !linebins.start || !tribins.start || !pool.tiles) abort();
+}
+
+/* Takes in what input has changed since the last frame: the camera, the
+   modes and what has to be drawn again. */
+static void latch(void)
+{
+    draw_cam = cam;
+    draw_solid = solid;
+    draw_hidden = hidden;
+    draw_hud = timing.hud;
+    if (redraw) stale = (Box){0, 0, width, height};
+    else stale = boxunion(stale, damaged);
+    redraw = 0;
+    damaged = (Box){0, 0, 0, 0};
+}
+
+/* Transforms and gathers the frame latched last and returns the part of the
+   screen it has to redraw, empty when nothing changed. Binning counts as
+   transform. */
+static Box prepare(void)
+{
+    Box b;
+    stage_begin();
+    transform();
+    collect();
+    if (threads > 1) binframe();
+    b = damage();
+    stage_end(STAGE_TRANSFORM);
+    return b;
+}
+
+/* Starts drawing screen pixels b, a box from prepare(), into c, which
+   covers them. With more than one thread the tiles are still being drawn
+   by the workers on return, so the caller may do other work before
+   render_finish(); the clears happen tile by tile inside raster. */
+static void render_start(Canvas c, Box b)
+{
+    int i;
+    Depth_Canvas d = jgl_depth_subcanvas(jgl_depth_canvas(zbuffer, hiz, width, height, screen_w), b.x0, b.y0, c.width, c.height);
+
+    stage_begin();
+    if (threads > 1) {
+        rasterstart(c, b);
+        return;
+    }
+    clear(c, d);
+    stage_end(STAGE_CLEAR);
+    for (i = 0; i < tri_len; i++)
+        drawtri(c, d, &tris[i], b.x0, b.y0);
+    for (i = 0; i < line_len; i++)
+        drawline(c, d, &lines[i], b.x0, b.y0);
+    stage_end(STAGE_RASTER);
+}
+
+/* The HUD forces whole-screen boxes, so it is only drawn on those. */
+static void render_finish(Canvas c)
+{
+    if (threads > 1) {
+        rasterwait();
+        stage_end(STAGE_RASTER);
+    }
+    if (draw_hud) {
+        drawhud(c);
+        stage_begin();
+    }
+}
+
+/* Draws the whole frame into c, which covers the screen, dirty or not. */
+static void render(Canvas c)
+{
+    latch();
+    prepare();
+    render_start(c, (Box){0, 0, width, height});
+    render_finish(c);
+}
+
+#ifndef TRINKET_NO_MAIN
+/* Recording (--record). Whoever draws a frame hands it to capture(), which
+   copies it into the next free slot of a small ring and returns; a writer
+   thread encodes the slots to the file in order and frees them. When the
+   writer falls behind and every slot is taken, frames are dropped and
+   counted rather than waited for, so disk speed never holds up a frame.
+   head counts frames queued and is only written by the drawing thread, tail
+   counts frames taken off by the writer; lock is held just long enough to
+   wake the writer. Files ending in .qoi get a QOI image per frame, anything
+   else a PAM (netpbm's RGBA format) per frame; both can be read back to
+   back, e.g. by ffmpeg -f image2pipe. */
+#define RECORD_SLOTS 4
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_t thread;
+    FILE *file;
+    int qoi, stopping;
+    uint32_t *slot[RECORD_SLOTS];
+    int w[RECORD_SLOTS], h[RECORD_SLOTS];
+    atomic_uint head, tail;
+    uint64_t written, dropped, failed;
+} Recorder;
+
+static Recorder rec = {.lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER};
+static int recording;
+
+static int writepam(FILE *f, const uint32_t *p, int w, int h)
+{
+    fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", w, h);
+    fwrite(p, sizeof(uint32_t), (size_t)w*h, f);
+    return ferror(f);
+}
+
+static void *recordloop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&rec.lock);
     for (;;) {
-        if (x1 > 0 && y1 > 0 && x1 < WIDTH && y1 < HEIGHT) {
-            dst[y1*WIDTH+x1] = color;
+        unsigned tail = atomic_load(&rec.tail);
+        if (tail == atomic_load(&rec.head)) {
+            if (rec.stopping) break;
+            pthread_cond_wait(&rec.queued, &rec.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&rec.lock);
+
+        int k = tail % RECORD_SLOTS;
+        if (rec.qoi ? qoi_write(rec.file, rec.slot[k], rec.w[k], rec.h[k], rec.w[k])
+                    : writepam(rec.file, rec.slot[k], rec.w[k], rec.h[k])) rec.failed++;
+        else rec.written++;
+        atomic_store(&rec.tail, tail + 1);
+
+        pthread_mutex_lock(&rec.lock);
+    }
+    pthread_mutex_unlock(&rec.lock);
+    return NULL;
+}
+
+/* Frees the slots and forgets the file, which the caller has closed. */
+static void recordfree(void)
+{
+    int i;
+    for (i = 0; i < RECORD_SLOTS; i++) {
+        free(rec.slot[i]);
+        rec.slot[i] = NULL;
+    }
+    rec.file = NULL;
+}
+
+/* Opens path and starts the writer; the framebuffer must be allocated. */
+static int startrecord(const char *path)
+{
+    size_t n = strlen(path);
+    int i;
+    if ((rec.file = fopen(path, "wb")) == NULL) return 0;
+    rec.qoi = n >= 4 && !strcmp(path + n - 4, ".qoi");
+    rec.stopping = 0;
+    atomic_store(&rec.head, 0);
+    atomic_store(&rec.tail, 0);
+    rec.written = rec.dropped = rec.failed = 0;
+    for (i = 0; i < RECORD_SLOTS; i++)
+        if ((rec.slot[i] = malloc((size_t)screen_w*screen_h * sizeof(uint32_t))) == NULL) abort();
+    if (pthread_create(&rec.thread, NULL, recordloop, NULL) != 0) {
+        fclose(rec.file);
+        recordfree();
+        return 0;
+    }
+    return 1;
+}
+
+/* Queues the w x h frame at p, rows screen_w apart, unless every slot is
+   still waiting to be written. */
+static void capture(const uint32_t *p, int w, int h)
+{
+    unsigned head = atomic_load(&rec.head);
+    int k = head % RECORD_SLOTS, y;
+    if (!recording) return;
+    if (head - atomic_load(&rec.tail) == RECORD_SLOTS) {
+        rec.dropped++;
+        return;
+    }
+    for (y = 0; y < h; y++)
+        memcpy(&rec.slot[k][y*w], &p[y*screen_w], w * sizeof(uint32_t));
+    rec.w[k] = w;
+    rec.h[k] = h;
+    atomic_store(&rec.head, head + 1);
+    pthread_mutex_lock(&rec.lock);
+    pthread_cond_signal(&rec.queued);
+    pthread_mutex_unlock(&rec.lock);
+}
+
+/* Writes out what is queued and closes the file. */
+static void stoprecord(void)
+{
+    if (!recording) return;
+    pthread_mutex_lock(&rec.lock);
+    rec.stopping = 1;
+    pthread_cond_signal(&rec.queued);
+    pthread_mutex_unlock(&rec.lock);
+    pthread_join(rec.thread, NULL);
+    if (fclose(rec.file) != 0) rec.failed++;
+    recordfree();
+    recording = 0;
+    printf("record: %llu frames written, %llu dropped, %llu failed\n",
+           (unsigned long long)rec.written, (unsigned long long)rec.dropped, (unsigned long long)rec.failed);
+}
+
+/* Export (--export NAME). Frames are drawn straight into a ring of
+   EXPORT_SLOTS framebuffers in the POSIX shared memory object NAME, for
+   other processes to map and read in place. The object starts with an
+   Export_Header; slot i's pixels are at offset + i*stride*height*4, each
+   frame in the top-left width x height of its slot.
+
+   A slot's sequence is 0 while a frame is being drawn into it and that
+   frame's number, counting from 1, once it is done. To read a slot, load its
+   sequence, use the pixels, and load it again: the frame is good if both
+   loads agree and are not 0. The header's sequence is the newest frame's
+   number and latest its slot. On Linux it is also a futex word, woken on
+   every frame, so a consumer can FUTEX_WAIT on the last value it saw
+   instead of polling. closed is set, and waiters woken, when trinket stops
+   exporting; the object is unlinked then but stays valid while mapped. */
+#define EXPORT_SLOTS 3
+#define EXPORT_MAGIC 0x544b5254     /* "TRKT" */
+#define EXPORT_VERSION 1
+#define EXPORT_OFFSET 4096
+
+typedef struct {
+    uint32_t magic, version, slots;
+    uint32_t width, height, stride;     /* largest frame; stride is in pixels */
+    uint32_t offset;                    /* bytes from here to slot 0 */
+    atomic_uint closed;
+    atomic_uint sequence;
+    atomic_uint latest;
+    struct {
+        atomic_uint sequence;
+        uint32_t width, height;
+    } slot[EXPORT_SLOTS];
+} Export_Header;
+
+static Export_Header *exported;
+static size_t export_size;
+static char export_name[256];
+static unsigned export_frame;
+
+static uint32_t *exportslot(int k)
+{
+    return (uint32_t *)((char *)exported + exported->offset) + (size_t)k*screen_w*screen_h;
+}
+
+/* Creates the object (a leading / is added when missing) and maps it; the
+   framebuffer must be allocated. Fails with EEXIST rather than take over
+   an object that is already there, which may be another trinket's live
+   ring: resizing it under a consumer's mapping would fault the consumer. */
+static int startexport(const char *name)
+{
+    int fd;
+    snprintf(export_name, sizeof(export_name), "%s%s", name[0] == '/' ? "" : "/", name);
+    export_size = EXPORT_OFFSET + (size_t)EXPORT_SLOTS*screen_w*screen_h * sizeof(uint32_t);
+    if ((fd = shm_open(export_name, O_CREAT | O_EXCL | O_RDWR, 0600)) < 0) return 0;
+    if (ftruncate(fd, export_size) != 0) {
+        close(fd);
+        shm_unlink(export_name);
+        return 0;
+    }
+    exported = mmap(NULL, export_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (exported == MAP_FAILED) {
+        exported = NULL;
+        shm_unlink(export_name);
+        return 0;
+    }
+    memset(exported, 0, sizeof(*exported));
+    exported->version = EXPORT_VERSION;
+    exported->slots = EXPORT_SLOTS;
+    exported->width = screen_w;
+    exported->height = screen_h;
+    exported->stride = screen_w;
+    exported->offset = EXPORT_OFFSET;
+    atomic_thread_fence(memory_order_release);
+    exported->magic = EXPORT_MAGIC;
+    return 1;
+}
+
+/* Reports why startexport(name) failed. */
+static void exportfailed(const char *name)
+{
+    if (errno == EEXIST)
+        fprintf(stderr, "%s: shared memory object %s already exists; another trinket may be exporting to it, "
+                        "or remove a stale one (on Linux, /dev/shm%s)\n", name, export_name, export_name);
+    else
+        perror(name);
+}
+
+static void exportwake(void)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &exported->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Marks slot k as being drawn and returns its pixels. */
+static uint32_t *beginexport(int k)
+{
+    atomic_store_explicit(&exported->slot[k].sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return exportslot(k);
+}
+
+/* Publishes the w x h frame drawn into slot k. */
+static void endexport(int k, int w, int h)
+{
+    exported->slot[k].width = w;
+    exported->slot[k].height = h;
+    atomic_store(&exported->slot[k].sequence, ++export_frame);
+    atomic_store(&exported->latest, k);
+    atomic_store(&exported->sequence, export_frame);
+    exportwake();
+}
+
+static void stopexport(void)
+{
+    if (exported == NULL) return;
+    atomic_store(&exported->closed, 1);
+    exportwake();
+    munmap(exported, export_size);
+    shm_unlink(export_name);
+    exported = NULL;
+}
+
+static int rendering;       /* --render-thread, window only */
+static int dynamic;         /* --dynamic, window only */
+
+#ifndef HEADLESS
+/* Frames are drawn straight into the streaming texture's own memory while
+   the box being redrawn is locked, at whatever pitch SDL hands back. Where it
+   cannot be locked, frames alternate between pixels and spare: frame N is
+   drawn into one while frame N-1 is uploaded from the other and presented,
+   so with worker threads the upload and present overlap raster at the cost
+   of a frame of latency. Each buffer then has to catch up on the previous
+   frame's box as well as its own, and uploaded is that previous box.
+   Untiled (threads <= 1) raster would not overlap anything, so the frame
+   is drawn into pixels and uploaded and presented in the same call.
+   Recording needs whole frames in host memory and so takes the second way. */
+static uint32_t *spare;
+static int zerocopy = 1, flip;
+static Box uploaded;
+static int uploaded_w, uploaded_h;
+
+#define IDLE_WAIT_MS 1000
+
+/* Dynamic resolution (--dynamic): a frame that costs more than the budget to
+   clear, transform, draw and upload drops the frame size by SCALE_STEP on
+   each side, down to SCALE_LEVELS steps; SCALE_SETTLE frames in a row that
+   would fit the budget one step larger (cost goes with the pixel count,
+   so SCALE_STEP squared) take a step back up. SDL scales the frame up to
+   the window when it is presented. */
+#define FRAME_BUDGET_NS 16666667
+#define SCALE_STEP 0.8f
+#define SCALE_LEVELS 6
+#define SCALE_SETTLE 30
+
+static int level, headroom;
+
+/* Called with the frame's stages timed, before frame_end(). */
+static void rescale(void)
+{
+    uint64_t *st = timing.stage[timing.frame % TIMING_FRAMES];
+    uint64_t cost = st[STAGE_CLEAR] + st[STAGE_TRANSFORM] + st[STAGE_RASTER] + st[STAGE_UPLOAD];
+    int l = level;
+    float k;
+
+    if (!dynamic) return;
+    if (cost > FRAME_BUDGET_NS) {
+        headroom = 0;
+        if (l < SCALE_LEVELS) l++;
+    }
+    else if (l > 0 && cost < FRAME_BUDGET_NS * SCALE_STEP * SCALE_STEP) {
+        if (++headroom >= SCALE_SETTLE) {
+            headroom = 0;
+            l--;
         }
-        if (x1 == x2 && y1 == y2) break;
-        e2 = 2*err;
-        if (e2 >= dy) {
-            err += dy;
-            x1 += sx;
+    }
+    else headroom = 0;
+    if (l == level) return;
+    level = l;
+    k = powf(SCALE_STEP, level);
+    setsize(fmaxf(1, floorf(screen_w * k)), fmaxf(1, floorf(screen_h * k)));
+}
+
+/* Forgets what was timed for a frame that turned out to need no drawing. */
+static void frame_skip(void)
+{
+    memset(timing.stage[timing.frame % TIMING_FRAMES], 0, sizeof(timing.stage[0]));
+}
+
+/* Shows the w x h frame in the texture's top-left corner across the window. */
+static void present(int w, int h)
+{
+    SDL_Rect r = {0, 0, w, h};
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, &r, NULL);
+    SDL_RenderPresent(renderer);
+}
+
+/* With --export every frame is drawn whole into the next slot of the ring,
+   since the slot still holds the frame from EXPORT_SLOTS frames back, so
+   the zero-copy path is not taken and the whole frame is rasterized. Only
+   the damaged box b is uploaded from the slot; the rest of the texture
+   already matches it. */
+static int drawexport(Box b)
+{
+    static int k;
+    if (boxempty(b)) {
+        frame_skip();
+        return 0;
+    }
+    k = (k + 1) % EXPORT_SLOTS;
+    uint32_t *p = beginexport(k);
+    Canvas c = jgl_canvas(p, width, height, screen_w);
+    render_start(c, (Box){0, 0, width, height});
+    render_finish(c);
+    capture(p, width, height);
+    endexport(k, width, height);
+    SDL_Rect r = {b.x0, b.y0, b.x1 - b.x0, b.y1 - b.y0};
+    SDL_UpdateTexture(texture, &r, p + b.y0*screen_w + b.x0, screen_w * sizeof(uint32_t));
+    stage_end(STAGE_UPLOAD);
+    present(width, height);
+    stage_end(STAGE_PRESENT);
+    rescale();
+    frame_end();
+    return 1;
+}
+
+/* Returns 0 when nothing needed drawing or uploading. */
+static int draw(void)
+{
+    Box b;
+    SDL_Rect r;
+    void *p;
+    int pitch;
+
+    latch();
+    b = prepare();
+    r = (SDL_Rect){b.x0, b.y0, b.x1 - b.x0, b.y1 - b.y0};
+    if (exported) return drawexport(b);
+    if (zerocopy && boxempty(b)) {
+        frame_skip();
+        return 0;
+    }
+    if (zerocopy && !recording && SDL_LockTexture(texture, &r, &p, &pitch) == 0) {
+        if (pitch % sizeof(uint32_t) == 0) {
+            Canvas c = jgl_canvas(p, r.w, r.h, pitch / sizeof(uint32_t));
+            render_start(c, b);
+            render_finish(c);
+            SDL_UnlockTexture(texture);
+            stage_end(STAGE_UPLOAD);
+            present(width, height);
+            stage_end(STAGE_PRESENT);
+            rescale();
+            frame_end();
+            return 1;
         }
-        if (e2 <= dx) {
-            err += dx;
-            y1 += sy;
+        SDL_UnlockTexture(texture);
+    }
+    if (zerocopy) {
+        zerocopy = 0;
+        if (threads > 1 && (spare = malloc((size_t)screen_w*screen_h * sizeof(uint32_t))) == NULL) abort();
+        b = (Box){0, 0, width, height};
+    }
+    if (threads <= 1) {
+        Canvas c;
+        if (boxempty(b)) {
+            frame_skip();
+            return 0;
         }
+        c = jgl_subcanvas(jgl_canvas(pixels, width, height, screen_w), b.x0, b.y0, b.x1 - b.x0, b.y1 - b.y0);
+        render_start(c, b);
+        render_finish(c);
+        capture(pixels, width, height);
+        r = (SDL_Rect){b.x0, b.y0, b.x1 - b.x0, b.y1 - b.y0};
+        SDL_UpdateTexture(texture, &r, pixels + b.y0*screen_w + b.x0, screen_w * sizeof(uint32_t));
+        stage_end(STAGE_UPLOAD);
+        present(width, height);
+        stage_end(STAGE_PRESENT);
+        rescale();
+        frame_end();
+        return 1;
+    }
+
+    Box fresh = boxunion(b, uploaded);
+    if (fresh.x1 > width) fresh.x1 = width;
+    if (fresh.y1 > height) fresh.y1 = height;
+    if (boxempty(fresh)) {
+        frame_skip();
+        return 0;
     }
+    uint32_t *front = flip ? spare : pixels, *back = flip ? pixels : spare;
+    Canvas c = jgl_subcanvas(jgl_canvas(front, width, height, screen_w), fresh.x0, fresh.y0, fresh.x1 - fresh.x0, fresh.y1 - fresh.y0);
+    render_start(c, fresh);
+    if (!boxempty(uploaded)) {
+        r = (SDL_Rect){uploaded.x0, uploaded.y0, uploaded.x1 - uploaded.x0, uploaded.y1 - uploaded.y0};
+        SDL_UpdateTexture(texture, &r, back + r.y*screen_w + r.x, screen_w * sizeof(uint32_t));
+        stage_end(STAGE_UPLOAD);
+        present(uploaded_w, uploaded_h);
+        stage_end(STAGE_PRESENT);
+    }
+    render_finish(c);
+    capture(front, width, height);
+    uploaded = b;
+    uploaded_w = width;
+    uploaded_h = height;
+    flip = !flip;
+    rescale();
+    frame_end();
+    return 1;
+}
+
+/* Render thread (--render-thread). Main keeps input, camera motion and SDL.
+   The render thread holds scene_lock only while latch() copies the camera,
+   modes and redraw state, then prepares and draws the frame into one of
+   three host buffers with the lock released, so input is taken in while a
+   frame is being prepared or drawn and lands in the next one. Main holds
+   the lock while it changes anything latch() reads and signals
+   scene_changed afterwards; with nothing to draw the render thread sleeps
+   on it. Main leaves the meshes alone once the thread has started, so they
+   and everything prepare() builds from them belong to the thread.
+   Buffers change hands without locking: the render thread owns
+   frames[back], main owns frames[showing], and ready holds the third index,
+   with FRAME_FRESH set while it is a finished frame main has not taken.
+   Each frame is drawn whole, since a buffer comes back two frames behind,
+   and frame_w/frame_h keep the size it was drawn at. Upload and present run
+   on main and are not timed. With --export the three buffers are the
+   ring's slots, so the newest frame is never the one being drawn. */
+#define FRAME_FRESH 4
+
+static pthread_mutex_t scene_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scene_changed = PTHREAD_COND_INITIALIZER;
+static pthread_t render_thread;
+static uint32_t *frames[3];
+static int frame_w[3], frame_h[3];
+static atomic_int ready;
+static int showing, quitting;
+static uint32_t frame_event;
+
+static void *renderloop(void *arg)
+{
+    int back = 1;
+    (void)arg;
+    pthread_mutex_lock(&scene_lock);
+    while (!quitting) {
+        latch();
+        pthread_mutex_unlock(&scene_lock);
+        Box b = prepare();
+        if (boxempty(b)) {
+            frame_skip();
+            pthread_mutex_lock(&scene_lock);
+            if (!quitting && !redraw && boxempty(damaged))
+                pthread_cond_wait(&scene_changed, &scene_lock);
+            continue;
+        }
+        int w = width, h = height;
+
+        if (exported) beginexport(back);
+        Canvas c = jgl_canvas(frames[back], w, h, screen_w);
+        render_start(c, (Box){0, 0, w, h});
+        render_finish(c);
+        capture(frames[back], w, h);
+        if (exported) endexport(back, w, h);
+        frame_w[back] = w;
+        frame_h[back] = h;
+        back = atomic_exchange(&ready, back | FRAME_FRESH) & ~FRAME_FRESH;
+        SDL_Event e = {.type = frame_event};
+        SDL_PushEvent(&e);
+        rescale();
+        frame_end();
+        pthread_mutex_lock(&scene_lock);
+    }
+    pthread_mutex_unlock(&scene_lock);
+    return NULL;
+}
+
+/* Returns 0 when the thread could not be started; main then draws itself. */
+static int startrender(void)
+{
+    if ((frame_event = SDL_RegisterEvents(1)) == (uint32_t)-1) return 0;
+    if (exported) {
+        frames[0] = exportslot(0);
+        frames[1] = exportslot(1);
+        frames[2] = exportslot(2);
+    }
+    else {
+        frames[0] = pixels;
+        frames[1] = malloc((size_t)screen_w*screen_h * sizeof(uint32_t));
+        frames[2] = malloc((size_t)screen_w*screen_h * sizeof(uint32_t));
+        if (frames[1] == NULL || frames[2] == NULL) abort();
+    }
+    showing = 0;
+    atomic_store(&ready, 2);
+    return pthread_create(&render_thread, NULL, renderloop, NULL) == 0;
+}
+
+static void stoprender(void)
+{
+    pthread_mutex_lock(&scene_lock);
+    quitting = 1;
+    pthread_cond_signal(&scene_changed);
+    pthread_mutex_unlock(&scene_lock);
+    pthread_join(render_thread, NULL);
 }
 
-static void draw(uint32_t *dst) 
+/* Puts up the newest finished frame, if main has not shown it yet; returns
+   whether there was one. */
+static int showframe(void)
 {
-    clear(dst);	
-    int i, j;
-	for(i = 0; i < scene.len; i++) {
-		Mesh *m = &scene.meshes[i];
-		for(j = 0; j < m->edge_len; j++) {
-			Edge *edge = &m->edges[j];
-			Vector3 a = add3d(edge->a, &m->position);
-			Vector3 b = add3d(edge->b, &m->position);
-			rot3d(&a, &cam.origin, &cam.rotation);
-			rot3d(&b, &cam.origin, &cam.rotation);
-			drawline(pixels, cam_project(&cam, add3d(&cam.origin, &a)), cam_project(&cam, add3d(&cam.origin, &b)), edge->color);
-		}
-	}
-    dst = pixels;
-	SDL_UpdateTexture(texture, NULL, dst, WIDTH * sizeof(uint32_t));
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
+    if (!(atomic_load(&ready) & FRAME_FRESH)) return 0;
+    showing = atomic_exchange(&ready, showing) & ~FRAME_FRESH;
+    SDL_Rect r = {0, 0, frame_w[showing], frame_h[showing]};
+    SDL_UpdateTexture(texture, &r, frames[showing], screen_w * sizeof(uint32_t));
+    present(r.w, r.h);
+    return 1;
 }
+#endif
+#endif
 
 /* Mesh transforms */
 
@@ -280,6 +2075,8 @@ Mesh *translate(Mesh *m, float x, float y, float z)
     Vector3 t = vector3(x, y, z);
     for (i=0; i<m->vert_len; i++)
         translate3d(&m->vertices[i], &t);
+    weld_reset(&m->weld);
+    updatebounds(m);
     return m;
 }
 
@@ -289,6 +2086,12 @@ Mesh *scale(Mesh *m, float x, float y, float z)
     Vector3 t = vector3(x, y, z);
     for (i=0; i<m->vert_len; i++)
         scale3d(&m->vertices[i], &t);
+    /* A mirror reverses every winding; turn the faces back outward. */
+    if (x*y*z < 0)
+        for (i=0; i<m->face_len; i++)
+            flipface(&m->faces[i]);
+    weld_reset(&m->weld);
+    updatebounds(m);
     return m;
 }
 
@@ -296,18 +2099,36 @@ Mesh *rotate(Mesh *m, float pitch, float yaw, float roll)
 {
     int i;
     Vector3 t = vector3(pitch, yaw, roll);
+    Matrix r = rotation3d(&m->position, &t);
     for (i=0; i<m->vert_len; i++)
-        rot3d(&m->vertices[i], &m->position, &t);
+        m->vertices[i] = apply3d(&r, m->vertices[i]);
+    weld_reset(&m->weld);
+    updatebounds(m);
     return m;
 }
 
+/* Copies the mesh by (x, y, z) and joins the copies: every vertex with an
+   edge, every edge with two faces, and every face is repeated on the copy. */
 Mesh *extrude(Mesh *m, float x, float y, float z, uint32_t color)
 {
-    int i, vl = m->vert_len, el = m->edge_len;
-    for (i=0; i<vl; i++)
-        addedge(m, &m->vertices[i], addvertex(m, m->vertices[i].x+x, m->vertices[i].y+y, m->vertices[i].z+z), color);
-    for (i=0; i<el; i++)
-        addedge(m, &m->vertices[vl + m->edges[i].a - &m->vertices[0]], &m->vertices[vl + m->edges[i].b - &m->vertices[0]], color);
+    int i, vl = m->vert_len, el = m->edge_len, fl = m->face_len;
+    uint32_t *copy = arena_alloc(&arena, vl * sizeof(uint32_t));
+    if (copy == NULL) abort();
+    for (i=0; i<vl; i++) {
+        copy[i] = addvertex(m, m->vertices[i].x+x, m->vertices[i].y+y, m->vertices[i].z+z);
+        addedge(m, i, copy[i], color);
+    }
+    for (i=0; i<el; i++) {
+        Edge e = m->edges[i];
+        addedge(m, copy[e.a], copy[e.b], color);
+        addface(m, e.a, e.b, copy[e.b], color);
+        addface(m, e.a, copy[e.b], copy[e.a], color);
+    }
+    for (i=0; i<fl; i++) {
+        Face f = m->faces[i];
+        addface(m, copy[f.a], copy[f.b], copy[f.c], m->face_colors[i]);
+    }
+    arena_release(&arena, copy, vl * sizeof(uint32_t));
     return m;
 }
 
@@ -315,22 +2136,65 @@ Mesh *extrude(Mesh *m, float x, float y, float z, uint32_t color)
 
 Mesh *addmesh(Scene *s)
 {
-    if (s->len == 128) {
-        return NULL;
+    Mesh *m;
+    if (s->len == s->cap) {
+        int cap = s->cap ? s->cap*2 : 16;
+        Mesh **meshes = arena_alloc(&arena, cap * sizeof(Mesh *));
+        if (meshes == NULL) return NULL;
+        if (s->len) memcpy(meshes, s->meshes, s->len * sizeof(Mesh *));
+        arena_release(&arena, s->meshes, s->cap * sizeof(Mesh *));
+        s->meshes = meshes;
+        s->cap = cap;
     }
-    s->meshes[s->len].vertices = _vertices;
-    s->meshes[s->len].edges = _edges;
-    return &s->meshes[s->len++];
+    if ((m = arena_alloc(&arena, sizeof(Mesh))) == NULL) return NULL;
+    memset(m, 0, sizeof(*m));
+    setweld(m, s->weld);
+    s->meshes[s->len++] = m;
+    return m;
+}
+
+/* Takes m out of the scene and hands its storage back to the arena. */
+void removemesh(Scene *s, Mesh *m)
+{
+    int i;
+    for (i=0; i<s->len && s->meshes[i] != m; i++);
+    if (i == s->len) return;
+    memmove(&s->meshes[i], &s->meshes[i+1], (s->len - i - 1) * sizeof(Mesh *));
+    s->len--;
+    damaged = boxunion(damaged, m->shown);
+    arena_release(&arena, m->vertices, m->vert_cap * sizeof(Vector3));
+    arena_release(&arena, m->edges, m->edge_cap * sizeof(Edge));
+    arena_release(&arena, m->colors, m->edge_cap * sizeof(uint32_t));
+    arena_release(&arena, m->faces, m->face_cap * sizeof(Face));
+    arena_release(&arena, m->face_colors, m->face_cap * sizeof(uint32_t));
+    arena_release(&arena, m->edge_faces, 2 * m->topo_edges * sizeof(uint32_t));
+    arena_release(&arena, m->weld.slots, m->weld.cap * sizeof(int));
+    arena_release(&arena, m, sizeof(Mesh));
+}
+
+/* Drops every mesh at once; the arena keeps its chunks for the next scene. */
+void resetscene(Scene *s)
+{
+    arena_reset(&arena);
+    redraw = 1;
+    s->meshes = NULL;
+    s->len = s->cap = 0;
 }
 
+/* A grid of lines over two faces spanning its outer corners. */
 Mesh *createplane(Scene *s, float w, float h, float xsegs, float ysegs, uint32_t color)
 {
     int ix, iy;
+    Edge left, right;
     Mesh *m = addmesh(s);
     for (ix=0; ix<xsegs+1; ix++)
         addline(m, vector3(ix * (w/xsegs) - w/2, h/2, 0), vector3(ix * (w/xsegs) - w/2, -h/2, 0), color);
+    left = m->edges[0];
+    right = m->edges[ix-1];
     for (iy=0; iy<ysegs+1; iy++)
         addline(m, vector3(w/2, iy * (h/ysegs) - h/2, 0), vector3(-w/2, iy * (h/ysegs) - h/2, 0), color);
+    addface(m, left.a, left.b, right.b, color);
+    addface(m, left.a, right.b, right.a, color);
     return m;
 }
 
@@ -341,18 +2205,25 @@ Mesh *createbox(Scene *s, float w, float h, float z, uint32_t color)
 
 /* Options */
 
-static void update(Camera *c, double speed)
+#ifndef TRINKET_NO_MAIN
+
+/* Moves the camera toward its targets; returns whether it moved. */
+static int update(Camera *c, double speed)
 {
     if(!equ3d(c->rotation, c->trotation) || !equ3d(c->origin, c->torigin)) {
         set3d(&c->rotation, lerp(c->rotation.x, c->trotation.x, speed, 1), lerp(c->rotation.y, c->trotation.y, speed, 1), lerp(c->rotation.z, c->trotation.z, speed, 1));
         set3d(&c->origin, lerp(c->origin.x, c->torigin.x, speed, 1), lerp(c->origin.y, c->torigin.y, speed, 1), lerp(c->origin.z, c->torigin.z, speed, 1));                    
+        return 1;
      }
+    return 0;
 }
 
+#ifndef HEADLESS
 static void modrange(int mod)
 {
     int res = cam.range + mod;
     if (res > 0 && res < 90 ) cam.range = res;
+    redraw = 1;
 }
 
 static void handle_key(SDL_Event *event)
@@ -380,50 +2251,331 @@ static void handle_key(SDL_Event *event)
         if (shift) addv3d(&cam.torigin, 0, -0.5, 0);
         else addv3d(&cam.trotation, -10, 0, 0);
         break;
+    case SDLK_t:
+        timing.hud = !timing.hud;
+        break;
+    case SDLK_f:
+        solid = !solid;
+        break;
+    case SDLK_h:
+        hidden = !hidden;
+        break;
     }
+    redraw = 1;
 }
+#endif
+#endif
 
-/********************************/
+/* Benchmark */
 
-int main(int argc, char* argv[]) {
-    int result = 0;
+#ifndef TRINKET_NO_MAIN
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    scene.len = 0;
+static uint64_t setup_ns;
+
+/* Renders `frames` frames into `pixels` with no window, turning the camera
+   the way a held arrow key would, and prints per-frame timing. Recording
+   and export count toward the frame times; with export, frames are drawn
+   into the ring instead. */
+static int bench(int frames)
+{
+    int i;
+    uint64_t *t = malloc(frames * sizeof(*t));
+    if (t == NULL) return 1;
+
+    render(jgl_canvas(pixels, width, height, screen_w));
+    frame_end();
+    memset(timing.total, 0, sizeof(timing.total));
+    timing.total_drawn = timing.total_culled = 0;
+    for (i=0; i<frames; i++) {
+        uint64_t t0 = now_ns();
+        uint32_t *p = exported ? beginexport(i % EXPORT_SLOTS) : pixels;
+        addv3d(&cam.trotation, 0, 3, 0);
+        update(&cam, 5);
+        render(jgl_canvas(p, width, height, screen_w));
+        capture(p, width, height);
+        if (exported) endexport(i % EXPORT_SLOTS, width, height);
+        t[i] = now_ns() - t0;
+        frame_end();
+    }
+    qsort(t, frames, sizeof(*t), cmp_u64);
+    printf("bench: %dx%d, %d meshes, %d frames, %s kernels, %d thread%s\n", width, height, scene.len, frames, jgl_kernels.name, threads, threads > 1 ? "s" : "");
+    int verts = 0, edges = 0;
+    for (i=0; i<scene.len; i++) {
+        verts += scene.meshes[i]->vert_len;
+        edges += scene.meshes[i]->edge_len;
+    }
+    printf("scene: %d vertices, %d edges, built in %.3f ms\n", verts, edges, setup_ns/1e6);
+    printf("meshes: %.1f drawn, %.1f culled (mean)\n", (double)timing.total_drawn/frames, (double)timing.total_culled/frames);
+    printf("arena: %.1f KiB reserved, %.1f KiB live, %.1f KiB peak\n", arena.reserved/1024.0, arena.live/1024.0, arena.peak/1024.0);
+    printf("min %.3f ms  median %.3f ms  p99 %.3f ms  (%.1f fps median)\n",
+           t[0]/1e6, t[frames/2]/1e6, t[(frames*99 + 99)/100 - 1]/1e6, 1e9/t[frames/2]);
+    for (i=0; i<STAGE_COUNT; i++)
+        printf("%s %.3f ms%s", stage_names[i], timing.total[i]/1e6/frames, i+1 < STAGE_COUNT ? "  " : " (mean)\n");
+    free(t);
+    return 0;
+}
+#endif
+
+/********************************/
+
+static void setup(int grid, float weld)
+{
+    resetscene(&scene);
     set3d(&scene.position, 0, 0, 0);
     set3d(&scene.scale, 1, 1, 1);
     set3d(&scene.rotation, 0, 0, 0);
+    scene.weld = weld;
     cam.range = 50;
     set3d(&cam.rotation, 180, 0, 0);
     set3d(&cam.trotation, 180, 0, 0);
 
+    rotate(createbox(&scene, 20, 20, 20, 0xff00ff00), 120, 45, 0);
+    if (grid > 0)
+        rotate(createplane(&scene, 60, 60, grid, grid, 0xff808080), 90, 0, 0);
+}
+
+/* Harnesses that include this file define TRINKET_NO_MAIN and bring their
+   own main(); what only main() and its frame loops use is left out with it. */
+#ifndef TRINKET_NO_MAIN
+#ifdef HEADLESS
+/* Headless export (--export NAME without -b): with no window there is no
+   input, so frames are drawn into the ring only when something changed, at
+   most one per SERVE_FRAME_NS while the camera eases toward its target,
+   until SIGINT or SIGTERM. SIGHUP rebuilds the scene. The flags are polled
+   every SERVE_IDLE_NS when idle, since the signal may land on a worker. */
+#define SERVE_FRAME_NS 16666667
+#define SERVE_IDLE_NS 100000000
+
+static volatile sig_atomic_t serve_stop, serve_reload;
+
+static void serve_signal(int sig)
+{
+    if (sig == SIGHUP) serve_reload = 1;
+    else serve_stop = 1;
+}
+
+static int serve(int grid, float weld)
+{
+    struct sigaction sa;
+    int k = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    while (!serve_stop) {
+        struct timespec ts = {0, SERVE_IDLE_NS};
+        if (serve_reload) {
+            serve_reload = 0;
+            setup(grid, weld);
+        }
+        if (update(&cam, 5)) redraw = 1;
+        if (redraw) {
+            uint32_t *p = beginexport(k);
+            render(jgl_canvas(p, width, height, screen_w));
+            capture(p, width, height);
+            endexport(k, width, height);
+            frame_end();
+            k = (k + 1) % EXPORT_SLOTS;
+            ts.tv_nsec = SERVE_FRAME_NS;
+        }
+        nanosleep(&ts, NULL);
+    }
+    printf("export: %u frames\n", export_frame);
+    return 0;
+}
+#endif
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b frames] [-g segments] [--hud] [-j threads] [--solid] [--hidden] [--render-thread] [--dynamic] [--size WxH] [--record file] [--export name] [--csv file]\n"
+                    "       [--no-cull] [--weld epsilon]\n", prog);
+    fprintf(stderr, "  -b, --bench N   render N frames headless and print frame times\n");
+    fprintf(stderr, "  -g, --grid N    add an NxN plane grid to the scene\n");
+    fprintf(stderr, "  -j, --threads N rasterize screen tiles on N threads (default: one per CPU,\n");
+    fprintf(stderr, "                  1: untiled on the main thread)\n");
+    fprintf(stderr, "      --solid     draw depth-tested faces instead of edges (toggle: f)\n");
+    fprintf(stderr, "      --hidden    draw only the edges not hidden by faces (toggle: h)\n");
+    fprintf(stderr, "      --render-thread\n");
+    fprintf(stderr, "                  draw on a thread of its own, apart from input\n");
+    fprintf(stderr, "      --dynamic   render smaller frames while they miss 60 fps and scale them\n");
+    fprintf(stderr, "                  up to the window\n");
+    fprintf(stderr, "      --size WxH  framebuffer size (default: the desktop's, 3072x1920 headless)\n");
+    fprintf(stderr, "      --hud       start with the stage timing overlay on (toggle: t)\n");
+    fprintf(stderr, "      --record FILE\n");
+    fprintf(stderr, "                  write every frame drawn to FILE, as QOI images if it ends\n");
+    fprintf(stderr, "                  in .qoi and PAM images otherwise, dropping frames the disk\n");
+    fprintf(stderr, "                  cannot keep up with\n");
+    fprintf(stderr, "      --export NAME\n");
+    fprintf(stderr, "                  draw frames into a ring of framebuffers in the shared memory\n");
+    fprintf(stderr, "                  object NAME for other processes to read; headless without -b,\n");
+    fprintf(stderr, "                  as the scene or camera change until SIGINT or SIGTERM\n");
+    fprintf(stderr, "                  (SIGHUP rebuilds the scene)\n");
+    fprintf(stderr, "      --csv FILE  write per-frame stage timings to FILE\n");
+    fprintf(stderr, "      --no-cull   draw every mesh and face, even out of view or facing away\n");
+    fprintf(stderr, "      --weld EPS  merge scene vertices less than EPS apart on every axis when\n");
+    fprintf(stderr, "                  building meshes (default: exact duplicates only)\n");
+}
+
+int main(int argc, char* argv[]) {
+    int i, frames = 0, grid = 0, sized = 0;
+    float weld = 0;
+    const char *record = NULL, *export = NULL;
+
+    for (i=1; i<argc; i++) {
+        if ((!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bench")) && i+1 < argc)
+            frames = atoi(argv[++i]);
+        else if ((!strcmp(argv[i], "-g") || !strcmp(argv[i], "--grid")) && i+1 < argc)
+            grid = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--hud"))
+            timing.hud = 1;
+        else if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--threads")) && i+1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--solid"))
+            solid = 1;
+        else if (!strcmp(argv[i], "--hidden"))
+            hidden = 1;
+        else if (!strcmp(argv[i], "--render-thread"))
+            rendering = 1;
+        else if (!strcmp(argv[i], "--record") && i+1 < argc)
+            record = argv[++i];
+        else if (!strcmp(argv[i], "--export") && i+1 < argc)
+            export = argv[++i];
+        else if (!strcmp(argv[i], "--dynamic"))
+            dynamic = 1;
+        else if (!strcmp(argv[i], "--size") && i+1 < argc && sscanf(argv[++i], "%dx%d", &screen_w, &screen_h) == 2 && screen_w > 0 && screen_h > 0)
+            sized = 1;
+        else if (!strcmp(argv[i], "--no-cull"))
+            cull = 0;
+        else if (!strcmp(argv[i], "--weld") && i+1 < argc)
+            weld = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--csv") && i+1 < argc) {
+            if (!open_csv(argv[++i])) {
+                perror(argv[i]);
+                return 1;
+            }
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    jgl_init();
+    startpool();
+    setup_ns = now_ns();
+    setup(grid, weld);
+    setup_ns = now_ns() - setup_ns;
+
+#ifdef HEADLESS
+    (void)sized;
+    if (frames <= 0 && export == NULL) frames = 300;
+#endif
+    if (frames > 0) {
+        allocscreen(screen_w, screen_h);
+        if (record && !(recording = startrecord(record))) {
+            perror(record);
+            return 1;
+        }
+        if (export && !startexport(export)) {
+            exportfailed(export);
+            return 1;
+        }
+        i = bench(frames);
+        stoprecord();
+        stopexport();
+        return i;
+    }
+
+#ifdef HEADLESS
+    allocscreen(screen_w, screen_h);
+    if (record && !(recording = startrecord(record))) {
+        perror(record);
+        return 1;
+    }
+    if (!startexport(export)) {
+        exportfailed(export);
+        return 1;
+    }
+    i = serve(grid, weld);
+    stoprecord();
+    stopexport();
+    return i;
+#endif
+
+#ifndef HEADLESS
+    int result = 0;
+    SDL_DisplayMode mode;
+
     if (SDL_Init(SDL_INIT_VIDEO) <0 ) return_defer(1);
 
+    if (!sized && SDL_GetDesktopDisplayMode(0, &mode) == 0) {
+        screen_w = mode.w;
+        screen_h = mode.h;
+    }
     window = SDL_CreateWindow(
         "Transparent Overlay",
         SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        WIDTH, HEIGHT,
+        screen_w, screen_h,
         SDL_WINDOW_BORDERLESS | SDL_WINDOW_SKIP_TASKBAR 
     );
     if (window == NULL) return_defer(1);
+    SDL_GetWindowSize(window, &screen_w, &screen_h);
+    allocscreen(screen_w, screen_h);
+    window_rect = (SDL_Rect){0, 0, screen_w, screen_h};
 
     renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
     if (renderer == NULL) return_defer(1);
     
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, screen_w, screen_h);
     if (texture == NULL) return_defer(1);
 
     SDL_SetWindowOpacity(window, 0.25f);
+    if (record && !(recording = startrecord(record))) {
+        perror(record);
+        return_defer(1);
+    }
+    if (export && !startexport(export)) {
+        exportfailed(export);
+        return_defer(1);
+    }
+    if (rendering) rendering = startrender();
     
-    rotate(createbox(&scene, 20, 20, 20, 0xff00ff00), 120, 45, 0);
-    draw(dst);    
+    /* Frames are only drawn when something changed; otherwise the loop sleeps
+       in SDL_WaitEventTimeout until there is input (or a second has passed,
+       to pick up anything marked dirty outside event handling). With a
+       render thread the loop also wakes for each frame it finishes, and the
+       camera takes its step when a new frame is put up rather than on every
+       wake-up, so it moves one step per frame drawn however much input
+       arrives. */
     for (;;) {
-        update(&cam, 5);
-        draw(dst);
-
+        int busy, got;
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
+
+        if (rendering) {
+            busy = showframe();
+            got = busy ? SDL_PollEvent(&event) : SDL_WaitEventTimeout(&event, IDLE_WAIT_MS);
+            pthread_mutex_lock(&scene_lock);
+            if (busy && update(&cam, 5)) redraw = 1;
+        }
+        else {
+            if (update(&cam, 5)) redraw = 1;
+            busy = draw();
+            got = busy ? SDL_PollEvent(&event) : SDL_WaitEventTimeout(&event, IDLE_WAIT_MS);
+        }
+        for (; got; got = SDL_PollEvent(&event)) {
             switch(event.type) {
             case SDL_QUIT:
+                if (rendering) {
+                    pthread_mutex_unlock(&scene_lock);
+                    stoprender();
+                }
                 return_defer(0);
                 break;
             case SDL_KEYDOWN:
@@ -432,13 +2584,21 @@ int main(int argc, char* argv[]) {
             case SDL_MOUSEWHEEL:
                 modrange(event.wheel.y);
                 break;  
+            case SDL_WINDOWEVENT:
+                redraw = 1;
+                break;
             }
         }
-        
+        if (rendering) {
+            pthread_cond_signal(&scene_changed);
+            pthread_mutex_unlock(&scene_lock);
+        }
     }
 
     
 defer:
+    stoprecord();
+    stopexport();
     switch (result) {
         case 0:
             printf("OK\n");
@@ -451,4 +2611,6 @@ defer:
     if (window) SDL_DestroyWindow(window);
     SDL_Quit();
     return result;
+#endif
 }
+#endif